@@ -1,7 +1,12 @@
+#include <sys/file.h>
 #include <time.h>
+#include <unistd.h>
 
+#include "alocacoes.h"
 #include "cgi.h"
 #include "estado.h"
+#include "token.h"
+#include "traco.h"
 
 /**
 @file Roguelike.c
@@ -23,6 +28,36 @@ Implementação de funções que tratam da impressão da interface do jogo das f
 /** \brief Número de píxeis por casa */
 #define ESCALA		40
 
+/** \brief Número de simulações feitas para estimar a dificuldade de um nível */
+#define CALIBRACAO_JOGOS		16
+
+/** \brief Número máximo de níveis gerados até se encontrar um com a dificuldade pretendida */
+#define MAX_CALIBRACOES			8
+
+/** \brief Número máximo de jogadas de cada simulação */
+#define MAX_JOGADAS_SIMULADAS	60
+
+/** \brief Em média, o bot escolhe uma jogada ao acaso uma vez em cada EXPLORACAO_BOT jogadas */
+#define EXPLORACAO_BOT			5
+
+/** \brief Probabilidade de sobrevivência pretendida (em percentagem) para um nível */
+#define SOBREVIVENCIA_ALVO(n)	(95 - 5 * (n))
+
+/** \brief Desvio máximo (em pontos percentuais) entre a sobrevivência estimada e a pretendida */
+#define BANDA_DIFICULDADE		15
+
+/** \brief Tamanho máximo de um URL gerado pelo jogo */
+#define TAMANHO_LINK	(TAMANHO_TOKEN + 128)
+
+/** \brief Intervalo (em segundos) entre atualizações da página de um espectador */
+#define PERIODO_ESPECTADOR	1
+
+/** \brief Alcance da visão do jogador quando o nevoeiro está ativo */
+#define RAIO_VISAO	6
+
+/** \brief Tamanho do buffer da resposta: uma página inteira cabe nele e é enviada com uma só escrita */
+#define TAMANHO_RESPOSTA	65536
+
 /**
 \brief Função que verifica se uma posição está dentro do tabuleiro de jogo.
 @param x Coluna
@@ -54,14 +89,7 @@ int posicao_igual(POSICAO p, int x, int y) {
          0 --> Não
 */
 int posicao_adjacente(POSICAO p1, POSICAO p2){
-	for (int dx = -1; dx <= 1; dx++) {
-		for (int dy = -1; dy <= 1; dy++) {
-			if ((p1.x + dx == p2.x) && (p1.y + dy == p2.y)) {
-				return 1;
-			}
-		}
-	}
-	return 0;
+	return abs(p1.x - p2.x) <= 1 && abs(p1.y - p2.y) <= 1;
 }
 
 /**
@@ -163,6 +191,65 @@ int tem_entrada(ESTADO e, int x, int y) {
 	}
 }
 
+/**
+\brief Função que constrói o mapa de ameaças, i.e., o número de inimigos que atacam cada casa.
+
+Uma casa é atacada por todos os inimigos que lhe são adjacentes, incluindo o que eventualmente a ocupa.
+@param e Estado
+@param ameacas Mapa a preencher, indexado por [linha][coluna]
+*/
+void calcular_ameacas(ESTADO e, int ameacas[TAMANHO][TAMANHO]) {
+	memset(ameacas, 0, sizeof(int) * TAMANHO * TAMANHO);
+
+	for (int i = 0; i < e.num_inimigos; i++) {
+		for (int dx = -1; dx <= 1; dx++) {
+			for (int dy = -1; dy <= 1; dy++) {
+				int x = e.inimigo[i].x + dx;
+				int y = e.inimigo[i].y + dy;
+				if (posicao_valida(x, y)) {
+					ameacas[y][x]++;
+				}
+			}
+		}
+	}
+}
+
+/**
+\brief Função que marca uma casa no mapa de ocupação, se a casa existir.
+@param ocupado Mapa de ocupação, com um bit por coluna em cada linha
+@param p Posição a marcar
+*/
+void marcar_ocupada(unsigned int ocupado[TAMANHO], POSICAO p) {
+	if (posicao_valida(p.x, p.y)) {
+		ocupado[p.y] |= 1u << p.x;
+	}
+}
+
+/**
+\brief Função que constrói o mapa de ocupação do tabuleiro, com as mesmas casas que posicao_ocupada.
+
+Com o mapa, saber se uma casa está ocupada custa uma só leitura, em vez de percorrer os inimigos e os obstáculos.
+@param e Estado
+@param ocupado Mapa a preencher, com um bit por coluna em cada linha
+*/
+void calcular_ocupacao(ESTADO e, unsigned int ocupado[TAMANHO]) {
+	memset(ocupado, 0, sizeof(unsigned int) * TAMANHO);
+
+	for (int i = 0; i < e.num_inimigos; i++) {
+		marcar_ocupada(ocupado, e.inimigo[i]);
+	}
+	for (int i = 0; i < e.num_obstaculos; i++) {
+		marcar_ocupada(ocupado, e.obstaculo[i]);
+	}
+	if (e.nivel > 1) {
+		marcar_ocupada(ocupado, e.entrada);
+	}
+	marcar_ocupada(ocupado, e.saida);
+	marcar_ocupada(ocupado, e.jogador);
+	marcar_ocupada(ocupado, e.pocao1);
+	marcar_ocupada(ocupado, e.pocao2);
+}
+
 /**
 \brief Função que verifica se uma posição está ocupada.
 @param e Estado
@@ -182,6 +269,49 @@ int posicao_ocupada(ESTADO e, int x, int y) {
 	return 0;
 }
 
+/**
+\brief Função que determina a ação que o jogador efetua ao deslocar-se para uma casa.
+@param e Estado
+@param x Coluna
+@param y Linha
+@returns Nome da ação ou NULL se o jogador não se puder deslocar para a casa
+*/
+char *acao_casa(ESTADO e, int x, int y) {
+	if (!posicao_valida(x, y) || tem_obstaculo(e, x, y) || tem_jogador(e, x, y) || tem_entrada(e, x, y))
+		return NULL;
+
+	if (tem_pocao1(e, x, y)) return "Apanhar_Pocao1";
+	if (tem_pocao2(e, x, y)) return "Apanhar_Pocao2";
+	if (tem_inimigo(e, x, y)) return "Matar_Inimigo";
+	if (tem_saida(e, x, y)) return "Movimentar_Saida";
+	return "Movimentar_Jogador";
+}
+
+/**
+\brief Função que calcula quantas vidas o jogador perde ao deslocar-se para uma casa.
+@param e Estado
+@param ameacas Mapa de ameaças do estado
+@param x Coluna
+@param y Linha
+@returns Número de vidas perdidas (um inimigo morto nessa casa já não ataca)
+*/
+int dano_jogada(ESTADO e, int ameacas[TAMANHO][TAMANHO], int x, int y) {
+	return ameacas[y][x] - tem_inimigo(e, x, y);
+}
+
+/**
+\brief Função que verifica se uma jogada mata o jogador.
+@param e Estado
+@param ameacas Mapa de ameaças do estado
+@param x Coluna
+@param y Linha
+@returns 1 --> Sim\n
+         0 --> Não
+*/
+int jogada_fatal(ESTADO e, int ameacas[TAMANHO][TAMANHO], int x, int y) {
+	return e.vidas_jogador - dano_jogada(e, ameacas, x, y) + tem_pocao1(e, x, y) <= 0;
+}
+
 /**
 \brief Função que inicializa a posição da entrada de um determinado nível do jogo.
 @param e Estado
@@ -282,6 +412,49 @@ ESTADO inicializar_obstaculos(ESTADO e, int num) {
 	return e;
 }
 
+/**
+\brief Função que verifica se o jogador consegue chegar à saída contornando os obstáculos.
+
+A pesquisa em largura é feita linha a linha sobre máscaras de bits: cada iteração expande de uma vez
+todas as casas alcançadas para as suas 8 vizinhas.
+@param e Estado
+@returns 1 --> Sim\n
+         0 --> Não
+*/
+int caminho_existe(ESTADO e) {
+	const unsigned int linha_cheia = (1u << TAMANHO) - 1;
+	unsigned int livre[TAMANHO], alcancado[TAMANHO];
+	int mudou;
+
+	for (int y = 0; y < TAMANHO; y++) {
+		livre[y] = linha_cheia;
+		alcancado[y] = 0;
+	}
+	for (int i = 0; i < e.num_obstaculos; i++) {
+		livre[e.obstaculo[i].y] &= ~(1u << e.obstaculo[i].x);
+	}
+	if (e.nivel > 1) {
+		livre[e.entrada.y] &= ~(1u << e.entrada.x);
+	}
+
+	alcancado[e.jogador.y] = 1u << e.jogador.x;
+	do {
+		mudou = 0;
+		for (int y = 0; y < TAMANHO; y++) {
+			unsigned int v = alcancado[y];
+			if (y > 0) v |= alcancado[y - 1];
+			if (y < TAMANHO - 1) v |= alcancado[y + 1];
+			v = (v | (v << 1) | (v >> 1)) & livre[y];
+			if ((v | alcancado[y]) != alcancado[y]) {
+				alcancado[y] |= v;
+				mudou = 1;
+			}
+		}
+	} while (mudou);
+
+	return (alcancado[e.saida.y] >> e.saida.x) & 1;
+}
+
 /**
 \brief Função que define a posição de uma poção nº1.
 @param e Estado
@@ -331,9 +504,134 @@ ESTADO inicializar_scores(ESTADO e, int *scores) {
 	return e;
 }
 
+/**
+\brief Função que escolhe a jogada do bot usado na calibração dos níveis.
+
+O bot é guloso: evita as casas atacadas, apanha a poção de vida e aproxima-se da saída; de vez em quando
+(1 em EXPLORACAO_BOT jogadas) escolhe uma jogada não fatal ao acaso, para que as simulações não sejam todas iguais.
+@param e Estado
+@param ameacas Mapa de ameaças do estado
+@param jogada Casa escolhida
+@returns 1 --> Há uma jogada não fatal\n
+         0 --> Todas as jogadas matam o jogador
+*/
+int escolher_jogada_bot(ESTADO e, int ameacas[TAMANHO][TAMANHO], POSICAO *jogada) {
+	int melhor = -2000000, candidatas = 0;
+	int explorar = random() % EXPLORACAO_BOT == 0;
+
+	for (int dx = -e.dif; dx <= e.dif; dx++) {
+		for (int dy = -e.dif; dy <= e.dif; dy++) {
+			int x = e.jogador.x + dx;
+			int y = e.jogador.y + dy;
+
+			if (acao_casa(e, x, y) == NULL || jogada_fatal(e, ameacas, x, y)) continue;
+
+			int distancia = abs(e.saida.x - x) > abs(e.saida.y - y) ? abs(e.saida.x - x) : abs(e.saida.y - y);
+			int valor = -1000 * dano_jogada(e, ameacas, x, y) + 1000 * tem_pocao1(e, x, y) - 10 * distancia + random() % 10;
+
+			candidatas++;
+			if (explorar ? random() % candidatas == 0 : valor > melhor) {
+				melhor = valor;
+				*jogada = (POSICAO){x, y};
+			}
+		}
+	}
+	return candidatas > 0;
+}
+
+/**
+\brief Função que simula um nível com o bot e verifica se este chega à saída.
+@param e Estado no início do nível
+@returns 1 --> O bot chegou à saída\n
+         0 --> O bot morreu ou esgotou as jogadas
+*/
+int simular_nivel(ESTADO e) {
+	int ameacas[TAMANHO][TAMANHO];
+	POSICAO jogada;
+
+	/* O nível pode estar a ser gerado para outro ecrã (por exemplo, o ranking depois de uma morte), mas o bot joga no tabuleiro */
+	e.mostrar_ecra = 0;
+
+	for (int i = 0; i < MAX_JOGADAS_SIMULADAS; i++) {
+		calcular_ameacas(e, ameacas);
+		if (!escolher_jogada_bot(e, ameacas, &jogada))
+			return 0;
+
+		char *acao = acao_casa(e, jogada.x, jogada.y);
+		if (strcmp(acao, "Movimentar_Saida") == 0)
+			return 1;
+
+		e = executar_acao(e, acao, jogada.x, jogada.y);
+	}
+	return 0;
+}
+
+/**
+\brief Função que estima a probabilidade de sobreviver a um nível, simulando-o CALIBRACAO_JOGOS vezes.
+@param e Estado no início do nível
+@returns Probabilidade estimada, em percentagem
+*/
+int estimar_sobrevivencia(ESTADO e) {
+	long long inicio = traco_inicio();
+	int sucessos = 0;
+
+	traco_suspender(1);
+	for (int i = 0; i < CALIBRACAO_JOGOS; i++) {
+		sucessos += simular_nivel(e);
+	}
+	traco_suspender(0);
+
+	traco_fim("estimar_sobrevivencia", inicio);
+	return sucessos * 100 / CALIBRACAO_JOGOS;
+}
+
+/**
+\brief Função que gera as peças de um nível: entrada, saída, jogador, inimigos, obstáculos e poções.
+@param e Estado
+@returns Estado modificado
+*/
+ESTADO gerar_nivel(ESTADO e) {
+	e = inicializar_entrada(e);
+	e = inicializar_saida(e);
+	e = inicializar_jogador(e);
+	e = inicializar_inimigos(e, INIMIGOS_NIVEL(e.nivel > NIVEL_MAXIMO ? NIVEL_MAXIMO : e.nivel));
+	do {
+		e = inicializar_obstaculos(e, MAX_OBSTACULOS);
+	} while (!caminho_existe(e));
+	e = inicializar_pocao1(e);
+	e = inicializar_pocao2(e);
+	return e;
+}
+
+/**
+\brief Função que gera um nível com a dificuldade pretendida.
+
+Cada nível gerado é simulado pelo bot; aceita-se o primeiro cuja probabilidade de sobrevivência fique a menos de
+BANDA_DIFICULDADE pontos percentuais do alvo do nível (que desce com o nível). Ao fim de MAX_CALIBRACOES tentativas,
+fica o nível mais próximo do alvo.
+@param e Estado
+@returns Estado modificado
+*/
+ESTADO gerar_nivel_calibrado(ESTADO e) {
+	int alvo = SOBREVIVENCIA_ALVO(e.nivel);
+	int erro_melhor = 101;
+	ESTADO melhor = e;
+
+	for (int i = 0; i < MAX_CALIBRACOES && erro_melhor > BANDA_DIFICULDADE; i++) {
+		ESTADO candidato = gerar_nivel(e);
+		int erro = abs(estimar_sobrevivencia(candidato) - alvo);
+
+		if (erro < erro_melhor) {
+			erro_melhor = erro;
+			melhor = candidato;
+		}
+	}
+	return melhor;
+}
+
 /**
 \brief Função que cria um nível, atualizando o estado do jogo.
-@param x Valor auxiliar para comparar o nº de jogadas efetuadas desde o momento em que o jogador apanhou a poção nº2
+@param turnos_pocao2 Número de jogadas que faltam para acabar o efeito da poção nº2
 @param dif Diferença entre a posição do jogador e uma possível casa para onde se pode deslocar
 @param nivel Nível
 @param score_atual Pontuação atual
@@ -351,11 +649,12 @@ ESTADO inicializar_scores(ESTADO e, int *scores) {
 @param idx_ultimo_score Índice do array correspondente à última pontuação
 @returns Estado modificado
 */
-ESTADO inicializar_estado(float x, int dif, int nivel, int score_atual, int *scores, int vidas_jogador, int inimigos_mortos, int mostrar_ecra, int mostrar_possiveis_casas_inimigos, int mostrar_possiveis_casas_jogador, int idx_ultimo_score) {
+ESTADO inicializar_estado(int turnos_pocao2, int dif, int nivel, int score_atual, int *scores, int vidas_jogador, int inimigos_mortos, int mostrar_ecra, int mostrar_possiveis_casas_inimigos, int mostrar_possiveis_casas_jogador, int idx_ultimo_score) {
+	long long inicio = traco_inicio();
 	ESTADO e;
 	memset(&e, 0, sizeof(ESTADO));
 
-	e.x = x;
+	e.turnos_pocao2 = turnos_pocao2;
 	e.dif = dif;
 	e.nivel = nivel;
 	e.score_atual = score_atual;
@@ -366,15 +665,10 @@ ESTADO inicializar_estado(float x, int dif, int nivel, int score_atual, int *sco
 	e.mostrar_possiveis_casas_jogador = mostrar_possiveis_casas_jogador;
 	e.idx_ultimo_score = idx_ultimo_score;
 
-	e = inicializar_entrada(e);
-	e = inicializar_saida(e);
-	e = inicializar_jogador(e);
-	e = inicializar_inimigos(e, 10 + e.nivel*2);
-	e = inicializar_obstaculos(e, 20);
-	e = inicializar_pocao1(e);
-	e = inicializar_pocao2(e);
+	e = gerar_nivel_calibrado(e);
 	e = inicializar_scores(e, scores);
 
+	traco_fim("inicializar_estado", inicio);
 	return e;
 }
 
@@ -429,52 +723,219 @@ ESTADO matar_inimigo(ESTADO e, int x, int y) {
 
 /**
 \brief Função que move todos os inimigos.
+
+O movimento é feito em duas fases, para que o resultado não dependa da ordem dos inimigos no array:
+primeiro cada inimigo propõe uma casa livre no estado inicial; depois, quando vários inimigos propõem
+a mesma casa, só se move o que parte da casa com menor índice (linha * TAMANHO + coluna).
 @param e estado
 @param novojogx Nova abcissa da posição do jogador
 @param novojogy Nova ordenada da posição do jogador
 @returns Estado modificado
 */
 ESTADO movimentar_inimigos(ESTADO e, int novojogx, int novojogy) {
+	long long inicio = traco_inicio();
 	POSICAO novojog = {novojogx, novojogy};
+	POSICAO destino[MAX_INIMIGOS];
+	int ameacas[TAMANHO][TAMANHO];
+	int vencedor[TAMANHO][TAMANHO];
+	unsigned int ocupado[TAMANHO];
+
+	calcular_ameacas(e, ameacas);
+	calcular_ocupacao(e, ocupado);
+	if (posicao_valida(novojogx, novojogy)) {
+		e.vidas_jogador -= ameacas[novojogy][novojogx];
+	}
 
 	for (int i = 0; i < e.num_inimigos; i++) {
-		if (posicao_adjacente(novojog, e.inimigo[i])) {
-			e.vidas_jogador--;
-		} 
-		else {
+		destino[i] = e.inimigo[i];
+		if (!posicao_adjacente(novojog, e.inimigo[i])) {
 			int dx = e.jogador.x - e.inimigo[i].x;
 			int dy = e.jogador.y - e.inimigo[i].y;
 			dx = sign(dx);
 			dy = sign(dy);
 			int x = e.inimigo[i].x + dx;
 			int y = e.inimigo[i].y + dy;
-			if (!posicao_ocupada(e, x, y)) {
-				e.inimigo[i].x = x;
-				e.inimigo[i].y = y;
+			if (!((ocupado[y] >> x) & 1)) {
+				destino[i] = (POSICAO){x, y};
 			}
 		}
 	}
+
+	memset(vencedor, -1, sizeof(vencedor));
+	for (int i = 0; i < e.num_inimigos; i++) {
+		if (posicao_igual(destino[i], e.inimigo[i].x, e.inimigo[i].y)) continue;
+
+		int k = vencedor[destino[i].y][destino[i].x];
+		if (k == -1 || e.inimigo[i].y * TAMANHO + e.inimigo[i].x < e.inimigo[k].y * TAMANHO + e.inimigo[k].x) {
+			vencedor[destino[i].y][destino[i].x] = i;
+		}
+	}
+
+	for (int i = 0; i < e.num_inimigos; i++) {
+		if (vencedor[destino[i].y][destino[i].x] == i) {
+			e.inimigo[i] = destino[i];
+		}
+	}
+
+	traco_fim("movimentar_inimigos", inicio);
 	return e;
 }
 
 /**
-\brief Função que imprime o tabuleiro de jogo.
+\brief Função que ilumina um octante do campo de visão do jogador (shadowcasting recursivo).
+@param opaco Casas que bloqueiam a visão, indexadas por [linha][coluna]
+@param visivel Casas visíveis, indexadas por [linha][coluna]
+@param origem Posição do jogador
+@param linha Distância ao jogador da primeira linha do octante a percorrer
+@param inicio Declive inicial da zona iluminada
+@param fim Declive final da zona iluminada
+@param octante Transformação (xx, xy, yx, yy) das coordenadas do octante para as do tabuleiro
 */
-void imprimir_tabuleiro() {
-	for(int y = 0; y < TAMANHO; y++) {
-		for(int x = 0; x < TAMANHO; x++) {
-			IMAGEM((float) x, (float) y, ESCALA, "grid.png");
+void iluminar_octante(int opaco[TAMANHO][TAMANHO], int visivel[TAMANHO][TAMANHO], POSICAO origem, int linha, float inicio, float fim, const int octante[4]) {
+	float novo_inicio = 0;
+
+	if (inicio < fim) return;
+
+	for (int j = linha; j <= RAIO_VISAO; j++) {
+		int bloqueado = 0;
+		int dy = -j;
+
+		for (int dx = -j; dx <= 0; dx++) {
+			float declive_esq = (dx - 0.5) / (dy + 0.5);
+			float declive_dir = (dx + 0.5) / (dy - 0.5);
+
+			if (inicio < declive_dir) continue;
+			if (fim > declive_esq) break;
+
+			int x = origem.x + dx * octante[0] + dy * octante[1];
+			int y = origem.y + dx * octante[2] + dy * octante[3];
+			int casa_opaca = !posicao_valida(x, y) || opaco[y][x];
+
+			if (posicao_valida(x, y) && dx * dx + dy * dy <= RAIO_VISAO * RAIO_VISAO) {
+				visivel[y][x] = 1;
+			}
+
+			if (bloqueado) {
+				if (casa_opaca) {
+					novo_inicio = declive_dir;
+				}
+				else {
+					bloqueado = 0;
+					inicio = novo_inicio;
+				}
+			}
+			else if (casa_opaca && j < RAIO_VISAO) {
+				bloqueado = 1;
+				iluminar_octante(opaco, visivel, origem, j + 1, inicio, declive_esq, octante);
+				novo_inicio = declive_dir;
+			}
 		}
+
+		if (bloqueado) break;
 	}
 }
 
+/**
+\brief Função que calcula as casas que o jogador consegue ver, tendo em conta os obstáculos.
+@param e Estado
+@param visivel Mapa a preencher, indexado por [linha][coluna] (1 --> visível, 0 --> escondida)
+*/
+void calcular_visibilidade(ESTADO e, int visivel[TAMANHO][TAMANHO]) {
+	static const int octantes[8][4] = {
+		{1, 0, 0, 1}, {0, 1, 1, 0}, {0, -1, 1, 0}, {-1, 0, 0, 1},
+		{-1, 0, 0, -1}, {0, -1, -1, 0}, {0, 1, -1, 0}, {1, 0, 0, -1}
+	};
+	int opaco[TAMANHO][TAMANHO];
+
+	memset(opaco, 0, sizeof(opaco));
+	memset(visivel, 0, sizeof(int) * TAMANHO * TAMANHO);
+
+	if (!e.nevoeiro) {
+		for (int y = 0; y < TAMANHO; y++) {
+			for (int x = 0; x < TAMANHO; x++) {
+				visivel[y][x] = 1;
+			}
+		}
+		return;
+	}
+
+	for (int i = 0; i < e.num_obstaculos; i++) {
+		opaco[e.obstaculo[i].y][e.obstaculo[i].x] = 1;
+	}
+
+	visivel[e.jogador.y][e.jogador.x] = 1;
+	for (int i = 0; i < 8; i++) {
+		iluminar_octante(opaco, visivel, e.jogador, 1, 1.0, 0.0, octantes[i]);
+	}
+}
+
+/**
+\brief Função que reduz um estado ao que o jogador consegue ver: os inimigos e as poções escondidos pelo nevoeiro são retirados.
+
+Os links das ações e as sugestões de jogadas são calculados sobre este estado, para não revelarem o que está escondido.
+@param e Estado
+@param visivel Casas visíveis
+@returns Estado reduzido
+*/
+ESTADO estado_visivel(ESTADO e, int visivel[TAMANHO][TAMANHO]) {
+	int n = 0;
+
+	for (int i = 0; i < e.num_inimigos; i++) {
+		if (visivel[e.inimigo[i].y][e.inimigo[i].x]) {
+			e.inimigo[n++] = e.inimigo[i];
+		}
+	}
+	e.num_inimigos = n;
+
+	if (posicao_valida(e.pocao1.x, e.pocao1.y) && !visivel[e.pocao1.y][e.pocao1.x]) {
+		e.pocao1 = (POSICAO){-1, -1};
+	}
+	if (posicao_valida(e.pocao2.x, e.pocao2.y) && !visivel[e.pocao2.y][e.pocao2.x]) {
+		e.pocao2 = (POSICAO){-1, -1};
+	}
+	return e;
+}
+
+/**
+\brief Função que imprime as definições usadas no tabuleiro: o padrão da grelha e os sprites das peças.
+
+Cada imagem é definida uma só vez; as peças limitam-se a referenciá-las com \<use\>.
+*/
+void imprimir_definicoes() {
+	printf("<defs>\n");
+	printf("<pattern id=grelha width=%d height=%d patternUnits=userSpaceOnUse>\n", ESCALA, ESCALA);
+	DEFINIR_SPRITE("casa", ESCALA, "grid.png");
+	printf("</pattern>\n");
+	printf("<g id=jogador>\n");
+	DEFINIR_SPRITE("jogador1", ESCALA, "player1.png");
+	DEFINIR_SPRITE("jogador2", ESCALA, "player2.png");
+	DEFINIR_SPRITE("jogador3", ESCALA, "player3.png");
+	DEFINIR_SPRITE("jogador4", ESCALA, "player4.png");
+	printf("</g>\n");
+	DEFINIR_SPRITE("inimigo", ESCALA, "enemy.png");
+	DEFINIR_SPRITE("obstaculo", ESCALA, "obstacle.png");
+	DEFINIR_SPRITE("entrada", ESCALA, "stone_stairs_up.png");
+	DEFINIR_SPRITE("saida", ESCALA, "stone_stairs_down.png");
+	DEFINIR_SPRITE("pocao1", ESCALA, "potion1.svg");
+	DEFINIR_SPRITE("pocao2", ESCALA, "potion2.svg");
+	DEFINIR_SPRITE("coracao", ESCALA, "heart.png");
+	printf("</defs>\n");
+}
+
+/**
+\brief Função que imprime o tabuleiro de jogo, como um só retângulo preenchido com o padrão da grelha.
+*/
+void imprimir_tabuleiro() {
+	printf("<rect width=%d height=%d fill=url(#grelha) />\n", TAMANHO * ESCALA, TAMANHO * ESCALA);
+}
+
 /**
 \brief Função que imprime a entrada.
 @param e Estado
 */
 void imprimir_entrada(ESTADO e) {
 	if (e.nivel >= 2) {
-		IMAGEM((float) e.entrada.x, (float) e.entrada.y, ESCALA, "stone_stairs_up.png");
+		USAR_SPRITE(e.entrada.x * ESCALA, e.entrada.y * ESCALA, "entrada");
 	}
 }
 
@@ -483,7 +944,7 @@ void imprimir_entrada(ESTADO e) {
 @param e Estado
 */
 void imprimir_saida(ESTADO e) {
-	IMAGEM((float) e.saida.x, (float) e.saida.y, ESCALA, "stone_stairs_down.png");
+	USAR_SPRITE(e.saida.x * ESCALA, e.saida.y * ESCALA, "saida");
 }
 
 /**
@@ -495,43 +956,83 @@ void imprimir_casa_transparente(int x, int y) {
 	QUADRADO_TRANSPARENTE(x, y, ESCALA);
 }
 
+/**
+\brief Função que constrói o URL de uma ação do jogo.
+
+No modo sem estado, o URL leva também o token assinado com o estado atual.
+@param e Estado
+@param acao Ação
+@param x Coluna
+@param y Linha
+@param link URL resultante (com pelo menos TAMANHO_LINK caracteres)
+*/
+void construir_link(ESTADO e, char *acao, int x, int y, char *link) {
+	int n = sprintf(link, CGI_PATH "?%s,%d,%d", acao, x, y);
+
+	if (modo_sem_estado()) {
+		link[n++] = ',';
+		estado2token(e, link + n);
+	}
+}
+
+/**
+\brief Função que abre um link para uma ação do jogo.
+@param e Estado
+@param acao Ação
+@param x Coluna
+@param y Linha
+*/
+void abrir_link_acao(ESTADO e, char *acao, int x, int y) {
+	char link[TAMANHO_LINK];
+	construir_link(e, acao, x, y, link);
+	ABRIR_LINK(link);
+}
+
+/**
+\brief Função que avalia uma jogada, simulando-a com as regras reais do jogo.
+@param e Estado
+@param ameacas Mapa de ameaças do estado
+@param x Coluna
+@param y Linha
+@returns Valor da jogada (quanto maior, melhor): privilegia as vidas, depois a pontuação e, por fim, a distância à saída
+*/
+int avaliar_jogada(ESTADO e, int ameacas[TAMANHO][TAMANHO], int x, int y) {
+	char *acao = acao_casa(e, x, y);
+
+	if (strcmp(acao, "Movimentar_Saida") == 0)
+		return 1000000;
+
+	if (jogada_fatal(e, ameacas, x, y))
+		return -1000000;
+
+	ESTADO s = executar_acao(e, acao, x, y);
+
+	int dx = abs(s.saida.x - x);
+	int dy = abs(s.saida.y - y);
+	int distancia = dx > dy ? dx : dy;
+
+	return 1000 * (s.vidas_jogador - e.vidas_jogador) + 10 * (s.score_atual - e.score_atual) - distancia;
+}
+
 /**
 \brief Função que imprime uma ação do jogador.
+
+A ação é a que o jogador consegue prever: numa casa escondida pelo nevoeiro, é sempre uma deslocação simples, e é o
+servidor que decide o que lá acontece.
 @param e Estado
+@param vista Estado reduzido ao que o jogador vê (ver estado_visivel)
 @param dx Coluna da ação em relação ao jogador
 @param dy Linha da ação em relação ao jogador
 */
-void imprimir_acao(ESTADO e, int dx, int dy) {
+void imprimir_acao(ESTADO e, ESTADO vista, int dx, int dy) {
 	int x = e.jogador.x + dx;
 	int y = e.jogador.y + dy;
-	char acao[32];
+	char *acao = acao_casa(vista, x, y);
 
-	if (!posicao_valida(x, y) || tem_obstaculo(e, x, y) || tem_jogador(e, x, y) || tem_entrada(e, x, y))
+	if (acao == NULL)
 		return;
 
-	if (tem_pocao1(e, x, y)) {
-		strcpy(acao, "Apanhar_Pocao1");
-	}
-
-	else if (tem_pocao2(e, x, y)) {
-		strcpy(acao, "Apanhar_Pocao2");
-	}
-
-	else if (tem_inimigo(e, x, y)) {
-		strcpy(acao, "Matar_Inimigo");
-	}
-
-	else if (tem_saida(e, x, y)) {
-		strcpy(acao, "Movimentar_Saida");
-	}
-
-	else {
-		strcpy(acao, "Movimentar_Jogador");
-	}
-
-	char link[2048];
-	sprintf(link, "http://localhost/cgi-bin/Roguelike?%s,%d,%d", acao, x, y);
-	ABRIR_LINK(link);
+	abrir_link_acao(e, acao, x, y);
 	imprimir_casa_transparente(x, y);
 	FECHAR_LINK;
 }
@@ -539,11 +1040,12 @@ void imprimir_acao(ESTADO e, int dx, int dy) {
 /**
 \brief Função que imprime as ações do jogador.
 @param e Estado
+@param vista Estado reduzido ao que o jogador vê (ver estado_visivel)
 */
-void imprimir_acoes(ESTADO e) {
+void imprimir_acoes(ESTADO e, ESTADO vista) {
 	for (int dx = -e.dif; dx <= e.dif; dx++) {
 		for (int dy = -e.dif; dy <= e.dif; dy++) {
-			imprimir_acao(e, dx, dy);
+			imprimir_acao(e, vista, dx, dy);
 		}
 	}
 }
@@ -553,46 +1055,47 @@ void imprimir_acoes(ESTADO e) {
 @param e Estado
 */
 void imprimir_jogador(ESTADO e) {
-	IMAGEM((float) e.jogador.x, (float) e.jogador.y, ESCALA, "player1.png");
-	IMAGEM((float) e.jogador.x, (float) e.jogador.y, ESCALA, "player2.png");
-	IMAGEM((float) e.jogador.x, (float) e.jogador.y, ESCALA, "player3.png");
-	IMAGEM((float) e.jogador.x, (float) e.jogador.y, ESCALA, "player4.png");
-	imprimir_acoes(e);
+	USAR_SPRITE(e.jogador.x * ESCALA, e.jogador.y * ESCALA, "jogador");
 }
 
 /**
-\brief Função que imprime os inimigos.
+\brief Função que imprime os inimigos visíveis.
 @param e Estado
+@param visivel Casas visíveis
 */
-void imprimir_inimigos(ESTADO e) {
+void imprimir_inimigos(ESTADO e, int visivel[TAMANHO][TAMANHO]) {
 	for(int i = 0; i < e.num_inimigos; i++) {
-		IMAGEM((float) e.inimigo[i].x, (float) e.inimigo[i].y, ESCALA, "enemy.png");
+		if (visivel[e.inimigo[i].y][e.inimigo[i].x])
+			USAR_SPRITE(e.inimigo[i].x * ESCALA, e.inimigo[i].y * ESCALA, "inimigo");
 	}
 }
 
 /**
-\brief Função que sinaliza a vermelho as casas para onde os inimigos se podem deslocar e, se for caso disso, atacar.
+\brief Função que sinaliza a vermelho as casas visíveis para onde os inimigos se podem deslocar e, se for caso disso, atacar.
+
+Só contam os inimigos que o jogador vê: uma casa atacada apenas por um inimigo escondido pelo nevoeiro não é sinalizada.
 @param e Estado
+@param vista Estado reduzido ao que o jogador vê (ver estado_visivel)
+@param visivel Casas visíveis
 */
-void imprimir_casas_atacadas(ESTADO e) {
+void imprimir_casas_atacadas(ESTADO e, ESTADO vista, int visivel[TAMANHO][TAMANHO]) {
 	if (e.mostrar_possiveis_casas_inimigos == 0) {
-		ABRIR_LINK("http://localhost/cgi-bin/Roguelike?Casas_Possiveis_Inimigo_Ativado");
+		abrir_link_acao(e, "Casas_Possiveis_Inimigo_Ativado", 0, 0);
 		TEXTO((TAMANHO + 1.0) * ESCALA, (TAMANHO - 1.0) * ESCALA, "#000000", "bold", "Mostrar casas onde os inimigos podem atacar");
 		FECHAR_LINK;
 	} 
 	else {
-		ABRIR_LINK("http://localhost/cgi-bin/Roguelike?Casas_Possiveis_Inimigo_Desativado");
+		abrir_link_acao(e, "Casas_Possiveis_Inimigo_Desativado", 0, 0);
 		TEXTO((TAMANHO + 1.0) * ESCALA, (TAMANHO - 1.0) * ESCALA, "#ff0000", "bold", "Ocultar casas onde os inimigos podem atacar");
 		FECHAR_LINK;
 
-		for (int k = 0; k < e.num_inimigos; k++) {
-			for (int dx = -1; dx <= 1; dx++) {
-				for (int dy = -1; dy <= 1; dy++) {
-					int x = e.inimigo[k].x + dx;
-					int y = e.inimigo[k].y + dy;
-					if (posicao_valida(x, y) && !posicao_igual(e.inimigo[k], x, y) && !tem_pocao1(e, x, y) && !tem_pocao2(e, x, y) && !tem_obstaculo(e, x, y) && !tem_saida(e, x, y) && !tem_entrada(e, x, y)) {
-						QUADRADO(x, y, ESCALA, "red");
-					}
+		int ameacas[TAMANHO][TAMANHO];
+		calcular_ameacas(vista, ameacas);
+
+		for (int y = 0; y < TAMANHO; y++) {
+			for (int x = 0; x < TAMANHO; x++) {
+				if (visivel[y][x] && ameacas[y][x] - tem_inimigo(vista, x, y) > 0 && !tem_pocao1(e, x, y) && !tem_pocao2(e, x, y) && !tem_obstaculo(e, x, y) && !tem_saida(e, x, y) && !tem_entrada(e, x, y)) {
+					QUADRADO(x, y, ESCALA, "red");
 				}
 			}
 		}
@@ -600,25 +1103,55 @@ void imprimir_casas_atacadas(ESTADO e) {
 }
 
 /**
-\brief Função que sinaliza a amarelo as casas para onde o jogador se pode movimentar no tabuleiro.
+\brief Função que sinaliza as casas para onde o jogador se pode movimentar no tabuleiro.
+
+Cada casa é avaliada simulando a jogada: a melhor é sinalizada a verde, as que custam vidas a laranja e as restantes a amarelo.
+A avaliação usa apenas o que o jogador vê, para não denunciar inimigos escondidos pelo nevoeiro.
 @param e Estado
+@param vista Estado reduzido ao que o jogador vê (ver estado_visivel)
 */
-void imprimir_casas_possiveis_jogador(ESTADO e) {
+void imprimir_casas_possiveis_jogador(ESTADO e, ESTADO vista) {
 	if (e.mostrar_possiveis_casas_jogador == 0) {
-		ABRIR_LINK("http://localhost/cgi-bin/Roguelike?Casas_Possiveis_Jogador_Ativado");
+		abrir_link_acao(e, "Casas_Possiveis_Jogador_Ativado", 0, 0);
 		TEXTO((TAMANHO + 1.0) * ESCALA, (TAMANHO - 0.1) * ESCALA, "#000000", "bold", "Mostrar casas para onde o jogador se pode deslocar");
 		FECHAR_LINK;
 	} 
 	else {
-		ABRIR_LINK("http://localhost/cgi-bin/Roguelike?Casas_Possiveis_Jogador_Desativado");
+		abrir_link_acao(e, "Casas_Possiveis_Jogador_Desativado", 0, 0);
 		TEXTO((TAMANHO + 1.0) * ESCALA, (TAMANHO - 0.1) * ESCALA, "#ffef00", "bold", "Ocultar casas para onde o jogador se pode deslocar");
 		FECHAR_LINK;
 
+		int valores[5][5];
+		int melhor = -2000000;
+		int ameacas[TAMANHO][TAMANHO];
+
+		calcular_ameacas(vista, ameacas);
+
+		for (int dx = -e.dif; dx <= e.dif; dx++) {
+			for (int dy = -e.dif; dy <= e.dif; dy++) {
+				int x = e.jogador.x + dx;
+				int y = e.jogador.y + dy;
+				if (acao_casa(vista, x, y) != NULL) {
+					valores[dx + 2][dy + 2] = avaliar_jogada(vista, ameacas, x, y);
+					if (valores[dx + 2][dy + 2] > melhor)
+						melhor = valores[dx + 2][dy + 2];
+				}
+			}
+		}
+
 		for (int dx = -e.dif; dx <= e.dif; dx++) {
 			for (int dy = -e.dif; dy <= e.dif; dy++) {
 				int x = e.jogador.x + dx;
 				int y = e.jogador.y + dy;
-				if (posicao_valida(x, y) && !tem_obstaculo(e, x, y) && !tem_jogador(e, x, y) && !tem_entrada(e, x, y)) {
+				if (acao_casa(vista, x, y) == NULL) continue;
+
+				if (valores[dx + 2][dy + 2] == melhor) {
+					QUADRADO(x, y, ESCALA, "lime");
+				}
+				else if (valores[dx + 2][dy + 2] < -500) {
+					QUADRADO(x, y, ESCALA, "orange");
+				}
+				else {
 					QUADRADO(x, y, ESCALA, "yellow");
 				}
 			}
@@ -626,33 +1159,72 @@ void imprimir_casas_possiveis_jogador(ESTADO e) {
 	}
 }
 
+/**
+\brief Função que escurece as casas que o jogador não consegue ver e imprime o botão que ativa/desativa o nevoeiro.
+@param e Estado
+@param visivel Casas visíveis
+*/
+void imprimir_nevoeiro(ESTADO e, int visivel[TAMANHO][TAMANHO]) {
+	if (e.nevoeiro == 0) {
+		abrir_link_acao(e, "Nevoeiro_Ativado", 0, 0);
+		TEXTO((TAMANHO + 1.0) * ESCALA, (TAMANHO - 1.9) * ESCALA, "#000000", "bold", "Ativar nevoeiro");
+		FECHAR_LINK;
+	}
+	else {
+		abrir_link_acao(e, "Nevoeiro_Desativado", 0, 0);
+		TEXTO((TAMANHO + 1.0) * ESCALA, (TAMANHO - 1.9) * ESCALA, "#808080", "bold", "Desativar nevoeiro");
+		FECHAR_LINK;
+
+		for (int y = 0; y < TAMANHO; y++) {
+			for (int x = 0; x < TAMANHO; x++) {
+				if (!visivel[y][x]) {
+					QUADRADO_OPACIDADE(x, y, ESCALA, "black", "0.8");
+				}
+			}
+		}
+	}
+}
+
 /**
 \brief Função que imprime os obstáculos.
 @param e Estado
 */
 void imprimir_obstaculos(ESTADO e) {
 	for(int i = 0; i < e.num_obstaculos; i++) {
-		IMAGEM((float) e.obstaculo[i].x, (float) e.obstaculo[i].y, ESCALA, "obstacle.png");
+		USAR_SPRITE(e.obstaculo[i].x * ESCALA, e.obstaculo[i].y * ESCALA, "obstaculo");
 	}
 }
 
+/**
+\brief Função que imprime a camada estática de um nível: o tabuleiro, os obstáculos, a entrada e a saída.
+@param e Estado
+*/
+void imprimir_camada_estatica(ESTADO e) {
+	imprimir_tabuleiro();
+	imprimir_obstaculos(e);
+	imprimir_entrada(e);
+	imprimir_saida(e);
+}
+
 /** 
 \brief Função que imprime a poção.
 @param e Estado
+@param visivel Casas visíveis
 */
-void imprimir_pocao1(ESTADO e) {
-	if (e.pocao1.x != -1 && e.pocao1.y != -1) {
-		IMAGEM((float) e.pocao1.x, (float) e.pocao1.y, ESCALA, "potion1.svg");
+void imprimir_pocao1(ESTADO e, int visivel[TAMANHO][TAMANHO]) {
+	if (e.pocao1.x != -1 && e.pocao1.y != -1 && visivel[e.pocao1.y][e.pocao1.x]) {
+		USAR_SPRITE(e.pocao1.x * ESCALA, e.pocao1.y * ESCALA, "pocao1");
 	}
 }
 
 /** 
 \brief Função que imprime a poção nº2.
 @param e Estado
+@param visivel Casas visíveis
 */
-void imprimir_pocao2(ESTADO e) {
-	if (e.pocao2.x != -1 && e.pocao2.y != -1) {
-		IMAGEM((float) e.pocao2.x, (float) e.pocao2.y, ESCALA, "potion2.svg");
+void imprimir_pocao2(ESTADO e, int visivel[TAMANHO][TAMANHO]) {
+	if (e.pocao2.x != -1 && e.pocao2.y != -1 && visivel[e.pocao2.y][e.pocao2.x]) {
+		USAR_SPRITE(e.pocao2.x * ESCALA, e.pocao2.y * ESCALA, "pocao2");
 	}
 }
 
@@ -706,26 +1278,26 @@ void imprimir_vidas(ESTADO e) {
 		if (v1 == 0) {
 			for(l = 0; l < v2; l++) {
 				for(c = 0; c < 10; c++) {
-					printf("<image x=%f y=%d width=%d height=%d xlink:href=%s />\n", (TAMANHO+2.5)*ESCALA + c*44, 115 + 44*l, 40, 40, "http://localhost/Imagens/heart.png");
+					USAR_SPRITE((TAMANHO+2.5)*ESCALA + c*44, 115 + 44*l, "coracao");
 				}
 			}
 		}
 
 		else if (v2 == 0) {
 			for(c = 0; c < v1; c++) {
-				printf("<image x=%f y=%d width=%d height=%d xlink:href=%s />\n", (TAMANHO+2.5)*ESCALA + c*44, 115, 40, 40, "http://localhost/Imagens/heart.png");
+				USAR_SPRITE((TAMANHO+2.5)*ESCALA + c*44, 115, "coracao");
 			}
 		}
 
 		else {
 			for(l = 0; l < v2; l++) {
 				for(c = 0; c < 10; c++) {
-					printf("<image x=%f y=%d width=%d height=%d xlink:href=%s />\n", (TAMANHO+2.5)*ESCALA + c*44, 115 + 44*l, 40, 40, "http://localhost/Imagens/heart.png");
+					USAR_SPRITE((TAMANHO+2.5)*ESCALA + c*44, 115 + 44*l, "coracao");
 				}
 			}
 			l++;
 			for(c = 0; c < v1; c++) {
-				printf("<image x=%f y=%d width=%d height=%d xlink:href=%s />\n", (TAMANHO+2.5)*ESCALA + c*44, 115 + 44*l, 40, 40, "http://localhost/Imagens/heart.png");
+				USAR_SPRITE((TAMANHO+2.5)*ESCALA + c*44, 115 + 44*l, "coracao");
 			}
 		}
 	}	
@@ -733,42 +1305,45 @@ void imprimir_vidas(ESTADO e) {
 
 /**
 \brief Função que imprime o menu.
+@param e Estado
 */
-void imprimir_menu() {
+void imprimir_menu(ESTADO e) {
 	printf("<image x=%d y=%d width=%d height=%f xlink:href=%s />\n", \
-			0, 0, (TAMANHO+10)*ESCALA, (TAMANHO - 0.5)*ESCALA, "http://localhost/Imagens/MenuBackground.jpg");
+			0, 0, (TAMANHO+10)*ESCALA, (TAMANHO - 0.5)*ESCALA, IMAGE_PATH "MenuBackground.jpg");
 
 	IMAGEM(4.0, 3.0, ESCALA, "play.svg");
-	ABRIR_LINK("http://localhost/cgi-bin/Roguelike?Inicio");
+	abrir_link_acao(e, "Inicio", 0, 0);
 	TEXTO((TAMANHO - 9.5) * ESCALA, (TAMANHO/2 - 3.3) * ESCALA, "#ffff00", "bold", "Jogar");
 	FECHAR_LINK;
 
 	IMAGEM(4.0, 5.0, ESCALA, "help.svg");
-	ABRIR_LINK("http://localhost/cgi-bin/Roguelike?Ajuda");
+	abrir_link_acao(e, "Ajuda", 0, 0);
 	TEXTO((TAMANHO - 9.5) * ESCALA, (TAMANHO/2 - 1.3) * ESCALA, "#ffffff", "bold", "Ajuda");
 	FECHAR_LINK;
 
 	IMAGEM(4.0, 7.0, ESCALA, "ranking.svg");
-	ABRIR_LINK("http://localhost/cgi-bin/Roguelike?Ranking");
+	abrir_link_acao(e, "Ranking", 0, 0);
 	TEXTO((TAMANHO - 9.5) * ESCALA, (TAMANHO/2 + 0.7) * ESCALA, "#ffffff", "bold", "Ranking");
 	FECHAR_LINK;
 }
 
 /**
 \brief Função que imprime o botão de regresso ao menu.
+@param e Estado
 */
-void imprimir_regressar_menu() {
-	ABRIR_LINK("http://localhost/cgi-bin/Roguelike?Menu");
+void imprimir_regressar_menu(ESTADO e) {
+	abrir_link_acao(e, "Menu", 0, 0);
 	IMAGEM(1.0, 1.0, ESCALA, "cross.svg");
 	FECHAR_LINK;
 }
 
 /**
 \brief Função que imprime o botão de regresso ao menu durante o jogo.
+@param e Estado
 */
-void imprimir_regressar_menu_jogo() {
-	ABRIR_LINK("http://localhost/cgi-bin/Roguelike?Menu");
-	printf("<image x=%f y=%d width=%d height=%d xlink:href=%s />\n", (TAMANHO+2.5)*ESCALA + 396, 0, 40, 40, "http://localhost/Imagens/cross.svg");
+void imprimir_regressar_menu_jogo(ESTADO e) {
+	abrir_link_acao(e, "Menu", 0, 0);
+	printf("<image x=%f y=%d width=%d height=%d xlink:href=%s />\n", (TAMANHO+2.5)*ESCALA + 396, 0, 40, 40, IMAGE_PATH "cross.svg");
 	FECHAR_LINK;
 }
 
@@ -780,7 +1355,7 @@ void imprimir_melhores_scores(ESTADO e) {
 	char s1[1000];
 
 	printf("<image x=%d y=%d width=%d height=%f xlink:href=%s />\n", \
-			0, 0, (TAMANHO+10)*ESCALA, (TAMANHO - 0.5)*ESCALA, "http://localhost/Imagens/MenuBackground.jpg");
+			0, 0, (TAMANHO+10)*ESCALA, (TAMANHO - 0.5)*ESCALA, IMAGE_PATH "MenuBackground.jpg");
 
 	TEXTO(4.5 * ESCALA, 2.0 * ESCALA, "#ffffff", "bold", "Top 5 de Pontuações");
 
@@ -815,15 +1390,21 @@ void imprimir_melhores_scores(ESTADO e) {
 		TEXTO(6.0 * ESCALA, 10.0*ESCALA, "#00ff00", "bold", s1);
 	}
 
-	imprimir_regressar_menu();
+	/* Sem ficheiro de estado, um link antigo pode repetir jogadas (ver VALIDADE_TOKEN): as pontuações não são verificadas */
+	if (modo_sem_estado()) {
+		TEXTO(4.5 * ESCALA, 11.5 * ESCALA, "#ff8c00", "normal", "Modo sem estado: pontuações não verificadas");
+	}
+
+	imprimir_regressar_menu(e);
 }
 
 /**
 \brief Função que imprime a página de ajuda.
+@param e Estado
 */
-void imprimir_ajuda() {
+void imprimir_ajuda(ESTADO e) {
 	printf("<image x=%d y=%d width=%d height=%f xlink:href=%s />\n", \
-			0, 0, (TAMANHO+10)*ESCALA, (TAMANHO - 0.5)*ESCALA, "http://localhost/Imagens/MenuBackground.jpg");
+			0, 0, (TAMANHO+10)*ESCALA, (TAMANHO - 0.5)*ESCALA, IMAGE_PATH "MenuBackground.jpg");
 
 	TEXTO((float) ESCALA, 3.0 * ESCALA, "#ffffff", "normal", "Bem-vindo ao Roguelike!");
 	TEXTO((float) ESCALA, 4.0 * ESCALA, "#ffffff", "bold", "Vidas de jogador:");
@@ -837,7 +1418,7 @@ void imprimir_ajuda() {
 	TEXTO(2.0 * ESCALA, 12.0 * ESCALA, "#ffffff", "normal", "Esta poção também te oferece mais 3 pontos.");
 	TEXTO((float) ESCALA, 13.0 * ESCALA, "#ffffff", "normal", "Boa sorte!");
 
-	imprimir_regressar_menu();
+	imprimir_regressar_menu(e);
 }
 
 /**
@@ -846,34 +1427,175 @@ void imprimir_ajuda() {
 */
 void imprimir_estado(ESTADO e) {
 	if (e.mostrar_ecra == 0) {
-		imprimir_tabuleiro();
-		imprimir_casas_atacadas(e);
-		imprimir_casas_possiveis_jogador(e);
-		imprimir_pocao1(e);
-		imprimir_pocao2(e);
-		imprimir_inimigos(e);
-		imprimir_obstaculos(e);
-		imprimir_entrada(e);
-		imprimir_saida(e);
-		imprimir_jogador(e);
-		imprimir_score(e);
-		imprimir_vidas(e);
-		imprimir_nivel(e);
-		imprimir_inimigos_mortos(e);
-		imprimir_regressar_menu_jogo();
+		int visivel[TAMANHO][TAMANHO];
+		calcular_visibilidade(e, visivel);
+		ESTADO vista = estado_visivel(e, visivel);
+
+		imprimir_definicoes();
+		TRACAR("imprimir_camada_estatica", imprimir_camada_estatica(e));
+		TRACAR("imprimir_casas_atacadas", imprimir_casas_atacadas(e, vista, visivel));
+		TRACAR("imprimir_casas_possiveis_jogador", imprimir_casas_possiveis_jogador(e, vista));
+		TRACAR("imprimir_pocoes", imprimir_pocao1(e, visivel); imprimir_pocao2(e, visivel));
+		TRACAR("imprimir_inimigos", imprimir_inimigos(e, visivel));
+		TRACAR("imprimir_nevoeiro", imprimir_nevoeiro(e, visivel));
+		TRACAR("imprimir_jogador", imprimir_jogador(e); imprimir_acoes(e, vista));
+		TRACAR("imprimir_painel", imprimir_score(e); imprimir_vidas(e); imprimir_nivel(e); imprimir_inimigos_mortos(e); imprimir_regressar_menu_jogo(e));
 	}
 
 	else if (e.mostrar_ecra == 1) {
-		imprimir_menu();
+		TRACAR("imprimir_menu", imprimir_menu(e));
 	}
 
 	else if (e.mostrar_ecra == 2) {
-		imprimir_melhores_scores(e);
+		TRACAR("imprimir_melhores_scores", imprimir_melhores_scores(e));
 	}
 
 	else if (e.mostrar_ecra == 3) {
-		imprimir_ajuda();
+		TRACAR("imprimir_ajuda", imprimir_ajuda(e));
+	}
+}
+
+/**
+\brief Função que imprime o jogo a decorrer para um espectador: tudo é visível e não há links de ações.
+
+Fora do tabuleiro (menu, ranking ou ajuda) não há jogo a decorrer, e o espectador é avisado disso em vez de ver o último tabuleiro.
+@param e Estado
+*/
+void imprimir_espectador(ESTADO e) {
+	int visivel[TAMANHO][TAMANHO];
+
+	if (e.mostrar_ecra != 0) {
+		TEXTO(4.5 * ESCALA, TAMANHO / 2.0 * ESCALA, "#000000", "bold", "Nenhum jogo a decorrer");
+		return;
 	}
+
+	e.nevoeiro = 0;
+	calcular_visibilidade(e, visivel);
+
+	imprimir_definicoes();
+	imprimir_camada_estatica(e);
+	imprimir_pocao1(e, visivel);
+	imprimir_pocao2(e, visivel);
+	imprimir_inimigos(e, visivel);
+	imprimir_jogador(e);
+	imprimir_score(e);
+	imprimir_vidas(e);
+	imprimir_nivel(e);
+	imprimir_inimigos_mortos(e);
+}
+
+/**
+\brief Função que responde a um pedido de um espectador, sem alterar o ficheiro de estado.
+
+Cada versão do jogo é identificada por um ETag: um espectador que já a tenha recebido recebe apenas "304 Not Modified",
+e a resposta pode ser guardada durante 1 segundo por caches partilhadas, que a distribuem a todos os espectadores.
+*/
+void responder_espectador() {
+	int fd = trancar_estado(LOCK_SH, ESPERA_LEITURA_MS);
+	ESTADO e = ficheiro2estado();
+	if (fd >= 0) close(fd);
+
+	char etag[16];
+	char *recebido = getenv("HTTP_IF_NONE_MATCH");
+
+	sprintf(etag, "\"%08x\"", (unsigned int) soma_verificacao(0, e));
+
+	/* As caches partilhadas só renovam a cópia que guardam se o 304 repetir o ETag e o Cache-Control */
+	printf("ETag: %s\n", etag);
+	printf("Cache-Control: public, max-age=%d\n", PERIODO_ESPECTADOR);
+
+	if (recebido != NULL && strcmp(recebido, etag) == 0) {
+		printf("Status: 304 Not Modified\n\n");
+		return;
+	}
+
+	printf("Refresh: %d; url=%s?Espectador\n", PERIODO_ESPECTADOR, CGI_PATH);
+	COMECAR_HTML;
+	ABRIR_SVG((TAMANHO + 13.5) * ESCALA, (TAMANHO + 0.5) * ESCALA);
+	imprimir_espectador(e);
+	FECHAR_SVG;
+}
+
+/**
+\brief Função que imprime uma posição em JSON ([x,y] ou null se a posição não existir).
+@param p Posição
+*/
+void imprimir_posicao_json(POSICAO p) {
+	if (p.x < 0 || p.y < 0) {
+		printf("null");
+	}
+	else {
+		printf("[%d,%d]", p.x, p.y);
+	}
+}
+
+/**
+\brief Função que imprime o estado em JSON, para clientes automáticos. No modo sem estado inclui o token para o pedido seguinte.
+@param e Estado
+@param lote Resumo do lote de ações aplicado (ver aplicar_lote)
+*/
+void imprimir_json(ESTADO e, LOTE lote) {
+	int visivel[TAMANHO][TAMANHO];
+	int primeiro = 1;
+
+	calcular_visibilidade(e, visivel);
+
+	COMECAR_JSON;
+	printf("{\"aplicadas\":%d,\"paragem\":\"%s\"", lote.aplicadas, lote.paragem);
+	printf(",\"ecra\":%d,\"nivel\":%d,\"score\":%d,\"vidas\":%d,\"jogadas\":%d,\"inimigos_mortos\":%d,\"alcance\":%d",
+			e.mostrar_ecra, e.nivel, e.score_atual, e.vidas_jogador, e.jogadas, e.inimigos_mortos, e.dif);
+
+	printf(",\"jogador\":");
+	imprimir_posicao_json(e.jogador);
+	printf(",\"entrada\":");
+	imprimir_posicao_json(e.nivel > 1 ? e.entrada : (POSICAO){-1, -1});
+	printf(",\"saida\":");
+	imprimir_posicao_json(e.saida);
+	printf(",\"pocao1\":");
+	imprimir_posicao_json(e.pocao1.x >= 0 && visivel[e.pocao1.y][e.pocao1.x] ? e.pocao1 : (POSICAO){-1, -1});
+	printf(",\"pocao2\":");
+	imprimir_posicao_json(e.pocao2.x >= 0 && visivel[e.pocao2.y][e.pocao2.x] ? e.pocao2 : (POSICAO){-1, -1});
+
+	printf(",\"inimigos\":[");
+	for (int i = 0; i < e.num_inimigos; i++) {
+		if (!visivel[e.inimigo[i].y][e.inimigo[i].x]) continue;
+		printf(primeiro ? "" : ",");
+		imprimir_posicao_json(e.inimigo[i]);
+		primeiro = 0;
+	}
+
+	printf("],\"obstaculos\":[");
+	for (int i = 0; i < e.num_obstaculos; i++) {
+		printf(i == 0 ? "" : ",");
+		imprimir_posicao_json(e.obstaculo[i]);
+	}
+
+	printf("],\"scores\":[");
+	for (int i = 0; i < NUM_SCORES; i++) {
+		printf(i == 0 ? "%d" : ",%d", e.scores[i]);
+	}
+	printf("]");
+
+	if (modo_sem_estado()) {
+		char token[TAMANHO_TOKEN];
+		estado2token(e, token);
+		printf(",\"token\":\"%s\"", token);
+	}
+	printf("}\n");
+}
+
+/**
+\brief Função que, no modo em tempo real, pede ao browser que volte a carregar o tabuleiro no fim de cada período.
+@param e Estado
+*/
+void imprimir_refrescamento(ESTADO e) {
+	char *periodo = getenv(VARIAVEL_TICK);
+	char link[TAMANHO_LINK];
+
+	if (periodo == NULL || atoi(periodo) <= 0 || e.mostrar_ecra != 0) return;
+
+	construir_link(e, "Tick", 0, 0, link);
+	printf("Refresh: %d; url=%s\n", atoi(periodo), link);
 }
 
 /**
@@ -881,11 +1603,34 @@ void imprimir_estado(ESTADO e) {
 @returns 0 Por convenção
 */
 int main() {
+	static char resposta[TAMANHO_RESPOSTA];
+	char *args = getenv("QUERY_STRING");
+
+	alocacoes_iniciar();
+	setvbuf(stdout, resposta, _IOFBF, sizeof(resposta));
 	srandom(time(NULL));
-	ESTADO e = ler_estado(getenv("QUERY_STRING"));
-	COMECAR_HTML;
-	ABRIR_SVG((TAMANHO + 13.5) * ESCALA, (TAMANHO + 0.5) * ESCALA);
-	imprimir_estado(e);
-	FECHAR_SVG;
+	traco_iniciar();
+
+	if (args != NULL && strcmp(args, "Espectador") == 0 && !modo_sem_estado()) {
+		responder_espectador();
+		return 0;
+	}
+
+	ESTADO e;
+
+	if (args != NULL && strncmp(args, "JSON", 4) == 0) {
+		LOTE lote;
+		e = aplicar_lote(args, &lote);
+		imprimir_json(e, lote);
+	}
+
+	else {
+		TRACAR("ler_estado", e = ler_estado(args));
+		imprimir_refrescamento(e);
+		COMECAR_HTML;
+		ABRIR_SVG((TAMANHO + 13.5) * ESCALA, (TAMANHO + 0.5) * ESCALA);
+		TRACAR("imprimir_estado", imprimir_estado(e));
+		FECHAR_SVG;
+	}
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,134 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "alocacoes.h"
+
+/**
+@file alocacoes.c
+Código da verificação de que um pedido não reserva memória dinâmica
+*/
+
+#ifdef CONTAR_ALOCACOES
+#include <assert.h>
+
+/** \brief Implementação do malloc da biblioteca C */
+extern void *__libc_malloc(size_t tamanho);
+
+/** \brief Implementação do calloc da biblioteca C */
+extern void *__libc_calloc(size_t numero, size_t tamanho);
+
+/** \brief Implementação do realloc da biblioteca C */
+extern void *__libc_realloc(void *p, size_t tamanho);
+
+/** \brief Implementação do memalign da biblioteca C, usada por todas as reservas alinhadas */
+extern void *__libc_memalign(size_t alinhamento, size_t tamanho);
+
+/** \brief Número de reservas de memória dinâmica feitas desde o início do pedido */
+static int alocacoes = 0;
+
+/**
+\brief Substitui o malloc de todo o programa (incluindo o da própria biblioteca C), contando as chamadas.
+@param tamanho o número de bytes a reservar
+@returns a memória reservada
+*/
+void *malloc(size_t tamanho) {
+	alocacoes++;
+	return __libc_malloc(tamanho);
+}
+
+/**
+\brief Substitui o calloc de todo o programa, contando as chamadas.
+@param numero o número de elementos
+@param tamanho o número de bytes de cada elemento
+@returns a memória reservada, a zeros
+*/
+void *calloc(size_t numero, size_t tamanho) {
+	alocacoes++;
+	return __libc_calloc(numero, tamanho);
+}
+
+/**
+\brief Substitui o realloc de todo o programa, contando as chamadas.
+@param p a memória a redimensionar
+@param tamanho o novo número de bytes
+@returns a memória redimensionada
+*/
+void *realloc(void *p, size_t tamanho) {
+	alocacoes++;
+	return __libc_realloc(p, tamanho);
+}
+
+/**
+\brief Substitui o reallocarray de todo o programa, contando as chamadas.
+@param p a memória a redimensionar
+@param numero o número de elementos
+@param tamanho o número de bytes de cada elemento
+@returns a memória redimensionada, ou NULL se numero * tamanho não couber num size_t
+*/
+void *reallocarray(void *p, size_t numero, size_t tamanho) {
+	alocacoes++;
+	if (tamanho != 0 && numero > SIZE_MAX / tamanho) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return __libc_realloc(p, numero * tamanho);
+}
+
+/**
+\brief Substitui o memalign de todo o programa, contando as chamadas.
+@param alinhamento o alinhamento pedido
+@param tamanho o número de bytes a reservar
+@returns a memória reservada
+*/
+void *memalign(size_t alinhamento, size_t tamanho) {
+	alocacoes++;
+	return __libc_memalign(alinhamento, tamanho);
+}
+
+/**
+\brief Substitui o aligned_alloc de todo o programa, contando as chamadas.
+@param alinhamento o alinhamento pedido
+@param tamanho o número de bytes a reservar
+@returns a memória reservada
+*/
+void *aligned_alloc(size_t alinhamento, size_t tamanho) {
+	alocacoes++;
+	return __libc_memalign(alinhamento, tamanho);
+}
+
+/**
+\brief Substitui o posix_memalign de todo o programa, contando as chamadas.
+@param p onde fica a memória reservada
+@param alinhamento o alinhamento pedido (uma potência de 2, múltipla de sizeof(void *))
+@param tamanho o número de bytes a reservar
+@returns 0 em caso de sucesso, EINVAL ou ENOMEM caso contrário
+*/
+int posix_memalign(void **p, size_t alinhamento, size_t tamanho) {
+	alocacoes++;
+	if (alinhamento % sizeof(void *) != 0 || (alinhamento & (alinhamento - 1)) != 0) return EINVAL;
+
+	void *q = __libc_memalign(alinhamento, tamanho);
+	if (q == NULL) return ENOMEM;
+	*p = q;
+	return 0;
+}
+
+/**
+\brief Função que verifica, no fim do pedido, que nenhuma reserva de memória dinâmica foi feita.
+*/
+static void verificar_alocacoes() {
+	if (alocacoes > 0) {
+		fprintf(stderr, "Roguelike: %d reservas de memória dinâmica durante o pedido\n", alocacoes);
+	}
+	assert(alocacoes == 0);
+}
+#endif
+
+void alocacoes_iniciar() {
+#ifdef CONTAR_ALOCACOES
+	alocacoes = 0;
+	atexit(verificar_alocacoes);
+#endif
+}
@@ -0,0 +1,17 @@
+#ifndef ___ALOCACOES_H___
+#define ___ALOCACOES_H___
+
+/**
+@file alocacoes.h
+Definição da verificação de que um pedido não reserva memória dinâmica (malloc e afins).
+*/
+
+/**
+\brief Função que prepara a verificação no início do pedido.
+
+Se o programa tiver sido compilado com CONTAR_ALOCACOES (make debug), verifica, no fim do pedido, que nenhuma função
+de reserva de memória dinâmica foi chamada; caso contrário, não faz nada.
+*/
+void alocacoes_iniciar();
+
+#endif
@@ -9,15 +9,29 @@ Macros úteis para gerar CGIs
 */
 
 /**
-\brief Caminho para as imagens
+\brief Caminho para as imagens (pode ser redefinido na compilação, p.ex. -DIMAGE_PATH=\"http://cdn/Imagens/\", para servir as imagens a partir de outro servidor)
 */
+#ifndef IMAGE_PATH
 #define IMAGE_PATH								"http://localhost/Imagens/"
+#endif
+
+/**
+\brief Caminho para o CGI do jogo (pode ser redefinido na compilação, tal como IMAGE_PATH)
+*/
+#ifndef CGI_PATH
+#define CGI_PATH								"http://localhost/cgi-bin/Roguelike"
+#endif
 
 /**
 \brief Macro para começar o html
 */
 #define COMECAR_HTML							printf("Content-Type: text/html; charset=utf-8\n\n")
 
+/**
+\brief Macro para começar uma resposta em JSON
+*/
+#define COMECAR_JSON							printf("Content-Type: application/json\n\n")
+
 /**
 \brief Macro para abrir um svg
 @param tamx O comprimento do svg
@@ -40,6 +54,23 @@ Macros úteis para gerar CGIs
 #define IMAGEM(X, Y, ESCALA, FICHEIRO)			printf("<image x=%f y=%f width=%d height=%d xlink:href=%s />\n", \
 														ESCALA * X, ESCALA * Y, ESCALA, ESCALA, IMAGE_PATH FICHEIRO)
 
+/**
+\brief Macro para definir um sprite (dentro de \<defs\>), que depois é desenhado com USAR_SPRITE
+@param ID O identificador do sprite
+@param ESCALA A largura e a altura do sprite
+@param FICHEIRO O caminho para o link do ficheiro
+*/
+#define DEFINIR_SPRITE(ID, ESCALA, FICHEIRO)	printf("<image id=%s width=%d height=%d xlink:href=%s />\n", \
+														ID, ESCALA, ESCALA, IMAGE_PATH FICHEIRO)
+
+/**
+\brief Macro para desenhar um sprite definido com DEFINIR_SPRITE
+@param X A coordenada X do canto superior esquerdo, em píxeis
+@param Y A coordenada Y do canto superior esquerdo, em píxeis
+@param ID O identificador do sprite
+*/
+#define USAR_SPRITE(X, Y, ID)					printf("<use xlink:href=#%s x=%g y=%g />\n", ID, (double) (X), (double) (Y))
+
 /**
 \brief Macro para criar um quadrado vermelho
 @param X A coordenada X do canto superior esquerdo
@@ -49,6 +80,17 @@ Macros úteis para gerar CGIs
 #define QUADRADO(X, Y, ESCALA, COLOR)			printf("<rect x=%d y=%d width=%d height=%d opacity=0.25 style=fill:%s />\n", \
 														ESCALA * X, ESCALA* Y, ESCALA, ESCALA, COLOR)
 
+/**
+\brief Macro para criar um quadrado com uma dada opacidade
+@param X A coordenada X do canto superior esquerdo
+@param Y A coordenada Y do canto superior esquerdo
+@param ESCALA A escala do quadrado
+@param COLOR A cor do quadrado
+@param OPACIDADE A opacidade do quadrado
+*/
+#define QUADRADO_OPACIDADE(X, Y, ESCALA, COLOR, OPACIDADE)	printf("<rect x=%d y=%d width=%d height=%d opacity=%s style=fill:%s />\n", \
+														ESCALA * X, ESCALA* Y, ESCALA, ESCALA, OPACIDADE, COLOR)
+
 /**
 \brief Macro para criar um quadrado transparente
 @param X A coordenada X do canto superior esquerdo
@@ -1,4 +1,11 @@
+#include <fcntl.h>
+#include <sys/file.h>
+#include <time.h>
+#include <unistd.h>
+
 #include "estado.h"
+#include "token.h"
+#include "traco.h"
 
 /**
 @file estado.c
@@ -6,190 +13,569 @@ Código do estado e das funções que convertem estados em ficheiros e vice-vers
 */
 
 /* <----------------------------------------- Headers de Funções de Roguelike.c ----------------------------------------------> */
-ESTADO inicializar_estado(float x, int dif, int nivel, int score_atual, int *scores, int vidas_jogador, int inimigos_mortos, int mostrar_ecra, \
+ESTADO inicializar_estado(int turnos_pocao2, int dif, int nivel, int score_atual, int *scores, int vidas_jogador, int inimigos_mortos, int mostrar_ecra, \
                           int mostrar_possiveis_casas_inimigos, int mostrar_possiveis_casas_jogador, int idx_ultimo_score);
 ESTADO atualizar_scores(ESTADO e);
 ESTADO matar_inimigo(ESTADO e, int x, int y);
 ESTADO movimentar_inimigos(ESTADO e, int a, int b);
+char *acao_casa(ESTADO e, int x, int y);
 /* <--------------------------------------------------------------------------------------------------------------------------> */
 
+/** \brief Número de bytes de cada cópia do estado no ficheiro: sequência, estado e soma de verificação */
+#define TAMANHO_COPIA		(2 * sizeof(int) + sizeof(ESTADO))
+
+/** \brief Converte o valor de uma macro numa string */
+#define EM_TEXTO(n)			TEXTO_LITERAL(n)
+
+/** \brief Converte um símbolo numa string */
+#define TEXTO_LITERAL(n)	#n
+
+/** \brief Formato do scanf que lê o nome de uma ação, limitado a LARGURA_ACAO caracteres */
+#define FORMATO_ACAO		"%" EM_TEXTO(LARGURA_ACAO)
+
+/** \brief Verifica, ao compilar, que o nome de uma ação cabe no buffer onde é lido (um nome cortado não corresponde a nenhuma ação) */
+#define VERIFICAR_ACAO(nome)	_Static_assert(sizeof(nome) <= TAMANHO_ACAO, "A ação " nome " não cabe em TAMANHO_ACAO")
+
+VERIFICAR_ACAO("Movimentar_Jogador");
+VERIFICAR_ACAO("Apanhar_Pocao1");
+VERIFICAR_ACAO("Apanhar_Pocao2");
+VERIFICAR_ACAO("Movimentar_Saida");
+VERIFICAR_ACAO("Matar_Inimigo");
+VERIFICAR_ACAO("Inicio");
+VERIFICAR_ACAO("Menu");
+VERIFICAR_ACAO("Ranking");
+VERIFICAR_ACAO("Ajuda");
+VERIFICAR_ACAO("Reset");
+VERIFICAR_ACAO("Casas_Possiveis_Inimigo_Ativado");
+VERIFICAR_ACAO("Casas_Possiveis_Inimigo_Desativado");
+VERIFICAR_ACAO("Casas_Possiveis_Jogador_Ativado");
+VERIFICAR_ACAO("Casas_Possiveis_Jogador_Desativado");
+VERIFICAR_ACAO("Nevoeiro_Ativado");
+VERIFICAR_ACAO("Nevoeiro_Desativado");
+VERIFICAR_ACAO("Tick");
+
+int soma_verificacao(int sequencia, ESTADO e) {
+	unsigned char *p = (unsigned char *) &e;
+	unsigned int h = 2166136261u;
+
+	for (unsigned int i = 0; i < sizeof(int); i++) {
+		h = (h ^ ((unsigned char *) &sequencia)[i]) * 16777619u;
+	}
+	for (unsigned int i = 0; i < sizeof(ESTADO); i++) {
+		h = (h ^ p[i]) * 16777619u;
+	}
+	return (int) h;
+}
+
+/**
+\brief Função que valida uma das duas cópias do estado lidas do ficheiro.
+@param copias o conteúdo do ficheiro de estado
+@param lidos o número de bytes lidos do ficheiro
+@param copia o índice da cópia (0 ou 1)
+@param e o estado lido
+@returns o número de sequência da cópia ou -1 se a cópia estiver vazia ou corrompida
+*/
+static int ler_copia(const unsigned char *copias, int lidos, int copia, ESTADO *e) {
+	const unsigned char *p = copias + copia * TAMANHO_COPIA;
+	int sequencia, soma;
+
+	if (lidos < (int) ((copia + 1) * TAMANHO_COPIA)) return -1;
+
+	memcpy(&sequencia, p, sizeof(int));
+	memcpy(e, p + sizeof(int), sizeof(ESTADO));
+	memcpy(&soma, p + sizeof(int) + sizeof(ESTADO), sizeof(int));
+
+	if (sequencia < 0 || soma != soma_verificacao(sequencia, *e)) return -1;
+	if (e->num_inimigos > MAX_INIMIGOS || e->num_obstaculos > MAX_OBSTACULOS) return -1;
+
+	return sequencia;
+}
+
+/**
+\brief Função que lê a cópia válida mais recente de um ficheiro com duas cópias do estado.
+@param fd o descritor do ficheiro
+@param e o estado lido
+@returns o número de sequência da cópia ou -1 se nenhuma cópia for válida
+*/
+static int ler_copias(int fd, ESTADO *e) {
+	unsigned char copias[2 * TAMANHO_COPIA];
+	ESTADO outra;
+
+	/* As duas cópias são lidas com uma só chamada ao sistema */
+	int lidos = pread(fd, copias, sizeof(copias), 0);
+	int sequencia = ler_copia(copias, lidos, 0, e);
+	int sequencia_outra = ler_copia(copias, lidos, 1, &outra);
+
+	if (sequencia_outra > sequencia) {
+		*e = outra;
+		sequencia = sequencia_outra;
+	}
+	return sequencia;
+}
+
+/**
+\brief Função que escreve um estado num ficheiro com duas cópias do estado, substituindo a mais antiga.
+@param fd o descritor do ficheiro
+@param e o estado
+@returns 1 se a cópia foi escrita, 0 caso contrário
+*/
+static int escrever_copia(int fd, ESTADO e) {
+	unsigned char copia[TAMANHO_COPIA];
+	ESTADO aux;
+
+	/* A nova cópia substitui a mais antiga, para que uma escrita interrompida nunca estrague a mais recente */
+	int sequencia = ler_copias(fd, &aux) + 1;
+	int soma = soma_verificacao(sequencia, e);
+
+	memcpy(copia, &sequencia, sizeof(int));
+	memcpy(copia + sizeof(int), &e, sizeof(ESTADO));
+	memcpy(copia + sizeof(int) + sizeof(ESTADO), &soma, sizeof(int));
+
+	if (pwrite(fd, copia, TAMANHO_COPIA, (sequencia % 2) * TAMANHO_COPIA) != (int) TAMANHO_COPIA) return 0;
+
+	if (getenv(VARIAVEL_DURABILIDADE) != NULL) {
+		fdatasync(fd);
+	}
+	return 1;
+}
+
+int trancar_estado(int operacao, int espera_ms) {
+	struct timespec um_ms = {0, 1000000};
+	int fd = open(FICHEIRO_ESTADO, O_RDONLY);
+
+	if (fd < 0) return -1;
+
+	for (int t = 0; flock(fd, operacao | LOCK_NB) != 0; t++) {
+		if (t >= espera_ms) {
+			printf("Status: 503 Service Unavailable\nRetry-After: %d\nContent-Type: text/plain; charset=utf-8\n\nServidor ocupado, tente novamente.\n", REPETIR_APOS);
+			exit(0);
+		}
+		nanosleep(&um_ms, NULL);
+	}
+	return fd;
+}
+
 ESTADO ficheiro2estado() {
-	FILE *f;
-	f = fopen(FICHEIRO_ESTADO, "r");
-	if (f == NULL) {
+	int fd = open(FICHEIRO_ESTADO, O_RDONLY);
+	if (fd < 0) {
 		perror("Erro a ler o ficheiro de estado");
 		exit(1);
 	}
 
 	ESTADO e;
-	int *p = (int *) &e;
-	unsigned int i;
-	int d;
+	int sequencia = ler_copias(fd, &e);
+	close(fd);
+
+	if (sequencia < 0) {
+		fd = open(FICHEIRO_SNAPSHOT, O_RDONLY);
+		if (fd >= 0) {
+			sequencia = ler_copias(fd, &e);
+			close(fd);
+		}
 
-	for(i = 0; i < (sizeof(ESTADO) / sizeof(int)); i++) {
-		if (fscanf(f, "%d", &d) != 1) {
-			e = inicializar_estado(0.5, 1, 1, 0, NULL, VIDAS, 0, 1, 0, 0, -1);
-			estado2ficheiro(e);
-			break;
+		if (sequencia < 0) {
+			e = inicializar_estado(0, 1, 1, 0, NULL, VIDAS, 0, 1, 0, 0, -1);
 		}
-		p[i] = d;
+		estado2ficheiro(e);
 	}
 
-	fclose(f);
-
 	return e;
 }
 
 void estado2ficheiro(ESTADO e) {
-	FILE *f;
-	f = fopen(FICHEIRO_ESTADO, "w");
-	if (f == NULL) {
+	int fd = open(FICHEIRO_ESTADO, O_RDWR | O_CREAT, 0666);
+	if (fd < 0 || !escrever_copia(fd, e)) {
 		perror("Erro a escrever o ficheiro de estado");
 		exit(1);
 	}
 
-	int *p = (int *) &e;
-	unsigned int i;
+	close(fd);
+}
 
-	for(i = 0; i < (sizeof(ESTADO) / sizeof(int)); i++)
-		fprintf(f, "%d\n", p[i]);
+void guardar_snapshot(ESTADO e) {
+	fflush(stdout);
 
-	fclose(f);
+	/* O processo principal (ou um fork falhado) segue logo em frente; a fotografia é só uma cópia de segurança */
+	if (fork() != 0) return;
+
+	/* O servidor web só dá a resposta por terminada quando todos os processos fecham o pedido: a entrada, a saída e os erros */
+	int nulo = open("/dev/null", O_RDWR);
+	for (int i = STDIN_FILENO; i <= STDERR_FILENO; i++) {
+		if (nulo >= 0) dup2(nulo, i);
+		else close(i);
+	}
+	if (nulo > STDERR_FILENO) close(nulo);
+	traco_descartar();
+
+	int fd = open(FICHEIRO_SNAPSHOT, O_RDWR);
+	if (fd >= 0) {
+		if (flock(fd, LOCK_EX) == 0) {
+			TRACAR("guardar_snapshot", escrever_copia(fd, e));
+		}
+		close(fd);
+	}
+
+	exit(0);
+}
+
+/**
+\brief Função que tira uma fotografia do estado quando o jogador passa de nível ou as jogadas deste pedido atingem um
+múltiplo de INTERVALO_SNAPSHOT.
+
+As jogadas voltam a contar do início em cada nível, pelo que a passagem de nível também tira uma fotografia: sem ela, um
+jogo feito de níveis curtos nunca seria guardado. Só o que acontece no próprio pedido conta: voltar a mostrar o mesmo
+estado (menu, ranking, Tick, ...) não repete a fotografia.
+@param lido Estado lido do ficheiro, antes do pedido
+@param e Estado depois do pedido
+*/
+static void fotografar(ESTADO lido, ESTADO e) {
+	int passou_nivel = e.nivel > lido.nivel;
+	int atingiu_intervalo = e.jogadas > lido.jogadas && e.jogadas / INTERVALO_SNAPSHOT != lido.jogadas / INTERVALO_SNAPSHOT;
+
+	if (passou_nivel || atingiu_intervalo) {
+		TRACAR("fork_snapshot", guardar_snapshot(e));
+	}
 }
 
 ESTADO ler_estado(char *args) {
-	char acao[32];
+	char acao[TAMANHO_ACAO];
+	char token[TAMANHO_TOKEN] = "";
 	int x = 0, y = 0;
-	int lidos = sscanf(args, "%[^,],%d,%d", acao, &x, &y);
+	int lidos = sscanf(args, FORMATO_ACAO "[^,],%d,%d,%511s", acao, &x, &y, token);
 
-	if (lidos >= 1) {
-		aplicar_acao(acao, x, y);
+	if (lidos < 1) {
+		strcpy(acao, "Menu");
+	}
+
+	if (modo_sem_estado()) {
+		return aplicar_acao_token(acao, x, y, token);
 	}
 	else {
-		aplicar_acao("Menu", x, y);
+		return aplicar_acao(acao, x, y);
 	}
+}
 
-	ESTADO e = ficheiro2estado();
+/**
+\brief Função que conta mais uma jogada sob o efeito da poção nº2, terminando o efeito ao fim de 3 jogadas.
+@param e o estado
+@returns Estado modificado
+*/
+static ESTADO gastar_pocao2(ESTADO e) {
+	if (e.turnos_pocao2 > 0 && --e.turnos_pocao2 == 0) {
+		e.dif = 1;
+	}
 	return e;
 }
 
-void aplicar_acao(char *acao, int x, int y) {
-	ESTADO e = ficheiro2estado();
+ESTADO avancar_tempo(ESTADO e) {
+	char *periodo = getenv(VARIAVEL_TICK);
+	int agora = (int) time(NULL);
 
-	if (strcmp(acao, "Movimentar_Jogador") == 0) {
-		e = movimentar_inimigos(e, x, y);
-		e.jogador.x = x;
-		e.jogador.y = y;
-		e.jogadas++;
+	if (periodo == NULL || atoi(periodo) <= 0 || e.mostrar_ecra != 0) return e;
 
-		if(e.jogadas - e.x == 3) {
-			e.dif = 1;
-			e.x = 0.5;
-		}
+	if (e.ultimo_tick == 0) {
+		e.ultimo_tick = agora;
+		return e;
 	}
 
-	else if(strcmp(acao, "Apanhar_Pocao1") == 0) {
-		e = movimentar_inimigos(e, x, y);
-		e.jogador.x = x;
-		e.jogador.y = y;
-		e.vidas_jogador++;
-		e.score_atual += 2;
-		e.pocao1.x = -1;
-		e.pocao1.y = -1;
-		e.jogadas++;
+	int ticks = (agora - e.ultimo_tick) / atoi(periodo);
+	e.ultimo_tick += ticks * atoi(periodo);
+	if (ticks > MAX_TICKS) {
+		ticks = MAX_TICKS;
+	}
 
-		if(e.jogadas - e.x == 3) {
-			e.dif = 1;
-			e.x = 0.5;
-		}
+	for (int i = 0; i < ticks && e.vidas_jogador > 0; i++) {
+		e = movimentar_inimigos(e, e.jogador.x, e.jogador.y);
 	}
+	return e;
+}
+
+/**
+\brief Função que verifica se uma ação respeita as regras do jogo.
+
+As ações que deslocam o jogador só são aceites se o tabuleiro estiver a ser mostrado, se a casa estiver ao seu alcance e se a ação for a que o jogo associa
+a essa casa (só se mata um inimigo onde há um inimigo, só se apanha uma poção onde ela está, ...); as restantes ações
+são sempre aceites. Assim, o score só pode crescer através de jogadas que o próprio jogo mostraria.
+@param e o estado
+@param acao a ação
+@param x coordenada x
+@param y coordenada y
+@returns 1 se a ação é permitida, 0 caso contrário
+*/
+static int acao_legal(ESTADO e, char *acao, int x, int y) {
+	static char *deslocacoes[] = {"Movimentar_Jogador", "Apanhar_Pocao1", "Apanhar_Pocao2", "Movimentar_Saida", "Matar_Inimigo"};
+	unsigned int i;
 
-	else if(strcmp(acao, "Apanhar_Pocao2") == 0) {
-		e = movimentar_inimigos(e, x, y);
-		e.jogador.x = x;
-		e.jogador.y = y;
-		e.pocao2.x = -1;
-		e.pocao2.y = -1;
-		e.dif = 2;
-		e.score_atual += 3;
-		e.jogadas++;
-		e.x = e.jogadas;
+	for (i = 0; i < sizeof(deslocacoes) / sizeof(deslocacoes[0]); i++) {
+		if (strcmp(acao, deslocacoes[i]) == 0) break;
 	}
+	if (i == sizeof(deslocacoes) / sizeof(deslocacoes[0])) return 1;
+
+	/* Fora do tabuleiro (menu, ranking, ajuda, ou depois de uma morte) não há jogo a decorrer onde jogar */
+	if (e.mostrar_ecra != 0) return 0;
+
+	if (abs(x - e.jogador.x) > e.dif || abs(y - e.jogador.y) > e.dif) return 0;
+
+	char *esperada = acao_casa(e, x, y);
+	return esperada != NULL && strcmp(esperada, acao) == 0;
+}
+
+/**
+\brief Função que determina a ação que uma jogada realmente efetua.
+
+Nas casas escondidas pelo nevoeiro o link é uma deslocação simples: o que acontece é o que a casa de destino determinar.
+@param e o estado
+@param acao a ação pedida
+@param x coordenada x
+@param y coordenada y
+@returns a ação a efetuar
+*/
+static char *resolver_acao(ESTADO e, char *acao, int x, int y) {
+	char *destino = acao_casa(e, x, y);
+
+	if (strcmp(acao, "Movimentar_Jogador") == 0 && destino != NULL) return destino;
+	return acao;
+}
+
+ESTADO executar_acao(ESTADO e, char *acao, int x, int y) {
+	acao = resolver_acao(e, acao, x, y);
+
+	/* Uma jogada que o jogo não permitiria (por exemplo, um URL forjado) é ignorada; a morte continua a ser tratada no fim */
+	if (acao_legal(e, acao, x, y)) {
+		if (strcmp(acao, "Movimentar_Jogador") == 0) {
+			e = movimentar_inimigos(e, x, y);
+			e.jogador.x = x;
+			e.jogador.y = y;
+			e.jogadas++;
 
-	else if (strcmp(acao, "Movimentar_Saida") == 0) {
-		if (e.nivel <= 10) {
-			e.nivel++;
-			e.score_atual += 10;
-			e.vidas_jogador += 3;
-			e = inicializar_estado(0.5, 1, e.nivel, e.score_atual, e.scores, e.vidas_jogador, e.inimigos_mortos, 0, e.mostrar_possiveis_casas_inimigos, e.mostrar_possiveis_casas_jogador, -1);
-		} else {
-			e.score_atual += 10;
-			e.score_atual += e.vidas_jogador * 2;
-			e = atualizar_scores(e);
-			e = inicializar_estado(0.5, 1, 1, e.score_atual, e.scores, VIDAS, 0, 2, 0, 0, e.idx_ultimo_score);
+			e = gastar_pocao2(e);
 		}
-		e.jogadas++;
-	}
 
-	else if (strcmp(acao, "Matar_Inimigo") == 0) {
-		e.score_atual += 5;
-		e = matar_inimigo(e, x, y);
-		e = movimentar_inimigos(e, x, y);
-		e.jogador.x = x;
-		e.jogador.y = y;
-		e.jogadas++;
+		else if(strcmp(acao, "Apanhar_Pocao1") == 0) {
+			e = movimentar_inimigos(e, x, y);
+			e.jogador.x = x;
+			e.jogador.y = y;
+			e.vidas_jogador++;
+			e.score_atual += 2;
+			e.pocao1.x = -1;
+			e.pocao1.y = -1;
+			e.jogadas++;
+
+			e = gastar_pocao2(e);
+		}
 
-		if(e.jogadas - e.x == 3) {
-			e.dif = 1;
-			e.x = 0.5;
+		else if(strcmp(acao, "Apanhar_Pocao2") == 0) {
+			e = movimentar_inimigos(e, x, y);
+			e.jogador.x = x;
+			e.jogador.y = y;
+			e.pocao2.x = -1;
+			e.pocao2.y = -1;
+			e.dif = 2;
+			e.score_atual += 3;
+			e.jogadas++;
+			e.turnos_pocao2 = 3;
 		}
-	}
 
-	else if (strcmp(acao, "Inicio") == 0) {
-		e = inicializar_estado(0.5, 1, 1, 0, e.scores, VIDAS, 0, 0, 0, 0, -1);
-	}
+		else if (strcmp(acao, "Movimentar_Saida") == 0) {
+			if (e.nivel < NIVEL_MAXIMO) {
+				e.nivel++;
+				e.score_atual += 10;
+				e.vidas_jogador += 3;
+				int nevoeiro = e.nevoeiro;
+				e = inicializar_estado(0, 1, e.nivel, e.score_atual, e.scores, e.vidas_jogador, e.inimigos_mortos, 0, e.mostrar_possiveis_casas_inimigos, e.mostrar_possiveis_casas_jogador, -1);
+				e.nevoeiro = nevoeiro;
+			} else {
+				e.score_atual += 10;
+				e.score_atual += e.vidas_jogador * 2;
+				e = atualizar_scores(e);
+				e = inicializar_estado(0, 1, 1, e.score_atual, e.scores, VIDAS, 0, 2, 0, 0, e.idx_ultimo_score);
+			}
+			e.jogadas++;
+		}
 
-	else if (strcmp(acao, "Menu") == 0) {
-		e.idx_ultimo_score = -1;
-		e.mostrar_ecra = 1;
-	}
+		else if (strcmp(acao, "Matar_Inimigo") == 0) {
+			e.score_atual += 5;
+			e = matar_inimigo(e, x, y);
+			e = movimentar_inimigos(e, x, y);
+			e.jogador.x = x;
+			e.jogador.y = y;
+			e.jogadas++;
 
-	else if (strcmp(acao, "Ranking") == 0) {
-		e.mostrar_ecra = 2;
-	}
+			e = gastar_pocao2(e);
+		}
 
-	else if (strcmp(acao, "Ajuda") == 0) {
-		e.mostrar_ecra = 3;
-	}
+		else if (strcmp(acao, "Inicio") == 0) {
+			e = inicializar_estado(0, 1, 1, 0, e.scores, VIDAS, 0, 0, 0, 0, -1);
+		}
 
-	else if (strcmp(acao, "Reset") == 0) {
-		e = inicializar_estado(0.5, 1, 1, 0, NULL, VIDAS, 0, 1, 0, 0, -1);
-	}
+		else if (strcmp(acao, "Menu") == 0) {
+			e.idx_ultimo_score = -1;
+			e.mostrar_ecra = 1;
+		}
+
+		else if (strcmp(acao, "Ranking") == 0) {
+			e.mostrar_ecra = 2;
+		}
+
+		else if (strcmp(acao, "Ajuda") == 0) {
+			e.mostrar_ecra = 3;
+		}
+
+		else if (strcmp(acao, "Reset") == 0) {
+			e = inicializar_estado(0, 1, 1, 0, NULL, VIDAS, 0, 1, 0, 0, -1);
+		}
+
+		else if (strcmp(acao, "Casas_Possiveis_Inimigo_Ativado") == 0) {
+			e.mostrar_possiveis_casas_inimigos = 1;
+		}
+
+		else if (strcmp(acao, "Casas_Possiveis_Inimigo_Desativado") == 0) {
+			e.mostrar_possiveis_casas_inimigos = 0;
+		}
+
+		else if (strcmp(acao, "Casas_Possiveis_Jogador_Ativado") == 0) {
+			e.mostrar_possiveis_casas_jogador = 1;	
+		}
 
-	else if (strcmp(acao, "Casas_Possiveis_Inimigo_Ativado") == 0) {
-		e.mostrar_possiveis_casas_inimigos = 1;
+		else if (strcmp(acao, "Casas_Possiveis_Jogador_Desativado") == 0) {
+			e.mostrar_possiveis_casas_jogador = 0;
+		}
+
+		else if (strcmp(acao, "Nevoeiro_Ativado") == 0) {
+			e.nevoeiro = 1;
+		}
+
+		else if (strcmp(acao, "Nevoeiro_Desativado") == 0) {
+			e.nevoeiro = 0;
+		}
+
+		else if (strcmp(acao, "Tick") == 0) {
+			/* Os inimigos já avançaram em avancar_tempo: basta voltar a mostrar o ecrã atual */
+		}
+
+		else {
+			e.mostrar_ecra = 1;
+		}
 	}
 
-	else if (strcmp(acao, "Casas_Possiveis_Inimigo_Desativado") == 0) {
-		e.mostrar_possiveis_casas_inimigos = 0;
+	if (e.vidas_jogador <= 0){
+		e = atualizar_scores(e);
+		e = inicializar_estado(0, 1, 1, e.score_atual, e.scores, VIDAS, 0, 2, 0, 0, e.idx_ultimo_score);
 	}
 
-	else if (strcmp(acao, "Casas_Possiveis_Jogador_Ativado") == 0) {
-		e.mostrar_possiveis_casas_jogador = 1;	
+	return e;
+}
+
+/**
+\brief Função que verifica se o estado depois de um pedido tem de ser escrito no ficheiro.
+
+O ecrã a mostrar é escolhido pela própria ação, pelo que navegar entre o menu, o ranking e a ajuda não obriga a escrever o
+ficheiro. Sair do tabuleiro obriga: é o ecrã guardado que suspende os avanços do modo em tempo real (ver avancar_tempo).
+@param lido Estado lido do ficheiro, antes do pedido
+@param e Estado depois do pedido
+@returns 1 se o ficheiro tiver de ser reescrito, 0 caso contrário
+*/
+static int estado_alterado(ESTADO lido, ESTADO e) {
+	if (lido.mostrar_ecra != 0 && e.mostrar_ecra != 0) lido.mostrar_ecra = e.mostrar_ecra;
+	return memcmp(&lido, &e, sizeof(ESTADO)) != 0;
+}
+
+ESTADO aplicar_acao(char *acao, int x, int y) {
+	int leitura = strcmp(acao, "Menu") == 0 || strcmp(acao, "Ranking") == 0 || strcmp(acao, "Ajuda") == 0;
+	long long inicio = traco_inicio();
+	int fd;
+	ESTADO lido, e;
+
+	TRACAR("trancar_estado", fd = trancar_estado(LOCK_EX, leitura ? ESPERA_LEITURA_MS : ESPERA_JOGADA_MS));
+	TRACAR("ficheiro2estado", lido = ficheiro2estado());
+	e = avancar_tempo(lido);
+	TRACAR("executar_acao", e = executar_acao(e, acao, x, y));
+
+	if (estado_alterado(lido, e)) {
+		TRACAR("estado2ficheiro", estado2ficheiro(e));
 	}
 
-	else if (strcmp(acao, "Casas_Possiveis_Jogador_Desativado") == 0) {
-		e.mostrar_possiveis_casas_jogador = 0;
+	/* Só depois de libertar o ficheiro de estado, para o processo filho não herdar o trinco */
+	if (fd >= 0) close(fd);
+	fotografar(lido, e);
+	traco_fim("aplicar_acao", inicio);
+	return e;
+}
+
+ESTADO aplicar_acao_token(char *acao, int x, int y, char *token) {
+	ESTADO e;
+
+	if (token[0] == '\0') {
+		e = inicializar_estado(0, 1, 1, 0, NULL, VIDAS, 0, 1, 0, 0, -1);
+	}
+	else if (!token2estado(token, &e)) {
+		return inicializar_estado(0, 1, 1, 0, NULL, VIDAS, 0, 1, 0, 0, -1);
 	}
 
+	e = avancar_tempo(e);
+	return executar_acao(e, acao, x, y);
+}
+
+ESTADO aplicar_lote(char *args, LOTE *lote) {
+	char token[TAMANHO_TOKEN] = "";
+	int sem_estado = modo_sem_estado();
+	int fd = -1;
+	ESTADO lido, e;
+
+	sscanf(args, "JSON,%511[^;]", token);
+	lote->aplicadas = 0;
+	lote->paragem = "fim";
+
+	if (sem_estado) {
+		if (token[0] == '\0') {
+			lido = inicializar_estado(0, 1, 1, 0, NULL, VIDAS, 0, 1, 0, 0, -1);
+		}
+		else if (!token2estado(token, &lido)) {
+			lote->paragem = "token";
+			return inicializar_estado(0, 1, 1, 0, NULL, VIDAS, 0, 1, 0, 0, -1);
+		}
+	}
 	else {
-		e.mostrar_ecra = 1;
+		TRACAR("trancar_estado", fd = trancar_estado(LOCK_EX, ESPERA_JOGADA_MS));
+		TRACAR("ficheiro2estado", lido = ficheiro2estado());
 	}
 
-	if (e.vidas_jogador <= 0){
-		e = atualizar_scores(e);
-		e = inicializar_estado(0.5, 1, 1, e.score_atual, e.scores, VIDAS, 0, 2, 0, 0, e.idx_ultimo_score);
+	e = avancar_tempo(lido);
+
+	for (char *p = strchr(args, ';'); p != NULL; p = strchr(p + 1, ';')) {
+		char acao[TAMANHO_ACAO];
+		int x = 0, y = 0;
+		int nivel = e.nivel, ecra = e.mostrar_ecra;
+
+		if (sscanf(p + 1, FORMATO_ACAO "[^,;],%d,%d", acao, &x, &y) < 1) {
+			lote->paragem = "invalida";
+			break;
+		}
+
+		/* As ações seguintes foram escolhidas a contar com esta: se o jogo a rejeitar, o lote pára aqui */
+		if (!acao_legal(e, resolver_acao(e, acao, x, y), x, y)) {
+			lote->paragem = "rejeitada";
+			break;
+		}
+
+		e = executar_acao(e, acao, x, y);
+		lote->aplicadas++;
+
+		if (ecra == 0 && e.nivel != nivel) {
+			lote->paragem = "nivel";
+			break;
+		}
+		if (ecra == 0 && e.mostrar_ecra != 0) {
+			lote->paragem = "ecra";
+			break;
+		}
+	}
+
+	if (!sem_estado && estado_alterado(lido, e)) {
+		TRACAR("estado2ficheiro", estado2ficheiro(e));
 	}
 
-	estado2ficheiro(e);
+	if (fd >= 0) close(fd);
+	if (!sem_estado) fotografar(lido, e);
+	return e;
 }
\ No newline at end of file
@@ -10,8 +10,14 @@
 Definição do estado e das funções que convertem estados em ficheiros e vice-versa.
 */
 
+/** \brief Último nível do jogo */
+#define NIVEL_MAXIMO		11
+
+/** \brief Número de inimigos de um nível */
+#define INIMIGOS_NIVEL(n)	(10 + (n) * 2)
+
 /** \brief Número máximo de inimigos */
-#define MAX_INIMIGOS		30
+#define MAX_INIMIGOS		INIMIGOS_NIVEL(NIVEL_MAXIMO)
 
 /** \brief Número máximo de obstáculos */
 #define MAX_OBSTACULOS		20
@@ -25,89 +31,222 @@ Definição do estado e das funções que convertem estados em ficheiros e vice-
 /** \brief Caminho do ficheiro de estado */
 #define FICHEIRO_ESTADO		"/var/www/html/estado"
 
+/** \brief Caminho do ficheiro com a última fotografia do estado, usada se as duas cópias do ficheiro de estado se estragarem */
+#define FICHEIRO_SNAPSHOT	"/var/www/html/snapshot"
+
+/** \brief Número de jogadas entre duas fotografias do estado (a passagem de nível também tira uma) */
+#define INTERVALO_SNAPSHOT	20
+
+/** \brief Variável de ambiente que, se estiver definida, obriga cada escrita do estado a chegar ao disco (fdatasync) */
+#define VARIAVEL_DURABILIDADE	"ROGUELIKE_FSYNC"
+
+/** \brief Variável de ambiente com o período (em segundos) do modo em tempo real; se não estiver definida, os inimigos só se movem quando o jogador joga */
+#define VARIAVEL_TICK			"ROGUELIKE_TICK"
+
+/** \brief Número máximo de avanços dos inimigos recuperados num só pedido */
+#define MAX_TICKS			10
+
+/** \brief Número máximo de caracteres do nome de uma ação num URL */
+#define LARGURA_ACAO		39
+
+/** \brief Tamanho do buffer onde se lê o nome de uma ação (o nome mais longo, "Casas_Possiveis_Inimigo_Desativado", tem 34 caracteres) */
+#define TAMANHO_ACAO		(LARGURA_ACAO + 1)
+
+/** \brief Tempo máximo (em milissegundos) que uma jogada espera pelo ficheiro de estado antes de ser recusada */
+#define ESPERA_JOGADA_MS		100
+
+/** \brief Tempo máximo (em milissegundos) que um pedido que só mostra um ecrã espera pelo ficheiro de estado */
+#define ESPERA_LEITURA_MS		500
+
+/** \brief Segundos indicados no cabeçalho Retry-After quando um pedido é recusado */
+#define REPETIR_APOS			1
+
 /**
-\brief Estrutura que armazena uma posição.
+\brief Estrutura que armazena uma posição (as coordenadas cabem num byte; -1 indica que a posição não existe).
 */
 typedef struct posicao {
 	/** \brief Coordenada x da posição */
-	int x;
+	signed char x;
 	/** \brief Coordenada y da posição */
-	int y;
+	signed char y;
 } POSICAO;
 
 /**
 \brief Estrutura que armazena o estado do jogo.
+
+Os campos estão ordenados de forma a não haver bytes de enchimento: os que são lidos em todas as jogadas vêm primeiro,
+para que uma jogada toque no menor número possível de linhas de cache, e os que só servem aos menus vêm no fim.
 */
 typedef struct estado {
 	/** \brief Posição do jogador */
 	POSICAO jogador;
-	/** \brief Valor auxiliar para comparar o nº de jogadas efetuadas desde o momento em que o jogador apanhou a poção nº2 */
-	float x;
-	/** \brief Diferença entre a posição do jogador e uma possível casa para onde se pode deslocar */
-	int dif;
-	/** \brief Número de jogadas */
-	int jogadas;
-	/** \brief Número de inimigos */
-	int num_inimigos;
-	/** \brief Número de obstáculos */
-	int num_obstaculos;
 	/** \brief Posição da poção nº1 */
 	POSICAO pocao1;
 	/** \brief Posição da poção nº2 */
 	POSICAO pocao2;
-	/** \brief Array com a posição dos inimigos */
-	POSICAO inimigo[MAX_INIMIGOS];
-	/** \brief Array com a posição dos obstáculos */
-	POSICAO obstaculo[MAX_OBSTACULOS];
 	/** \brief Posição da entrada */
 	POSICAO entrada;
 	/** \brief Posição da saída */
 	POSICAO saida;
+	/** \brief Diferença entre a posição do jogador e uma possível casa para onde se pode deslocar */
+	unsigned char dif;
+	/** \brief Número de jogadas que faltam para acabar o efeito da poção nº2 */
+	unsigned char turnos_pocao2;
 	/** \brief Nível atual */
-	int nivel;
-	/** \brief Score atual */
-	int score_atual;
-	/** \brief Array com os scores */
-	int scores[NUM_SCORES];
+	unsigned char nivel;
+	/** \brief Número de inimigos */
+	unsigned char num_inimigos;
+	/** \brief Número de obstáculos */
+	unsigned char num_obstaculos;
 	/** \brief Índice do último score (0-4 se está nos scores, -1 se não, -2 se é o mais recente) */
-	int idx_ultimo_score;
+	signed char idx_ultimo_score;
 	/** \brief Número de vidas do jogador */
 	int vidas_jogador;
+	/** \brief Número de jogadas */
+	int jogadas;
+	/** \brief Score atual */
+	int score_atual;
+	/** \brief Array com a posição dos inimigos */
+	POSICAO inimigo[MAX_INIMIGOS];
+	/** \brief Array com a posição dos obstáculos */
+	POSICAO obstaculo[MAX_OBSTACULOS];
 	/** \brief Número de inimigos mortos */
 	int inimigos_mortos;
+	/** \brief Instante (em segundos) do último avanço dos inimigos no modo em tempo real */
+	int ultimo_tick;
+	/** \brief Array com os scores */
+	int scores[NUM_SCORES];
 	/** \brief Ecrã a ser mostrado (0 tabuleiro, 1 menu, 2 melhores scores, 3 ajuda) */
-	int mostrar_ecra;
+	unsigned int mostrar_ecra : 2;
 	/** \brief Mostrar casas para onde os inimigos se podem deslocar e, se for caso disso, atacar */
-	int mostrar_possiveis_casas_inimigos;
+	unsigned int mostrar_possiveis_casas_inimigos : 1;
 	/** \brief Mostrar as casas para onde o jogador se poderá deslocar */
-	int mostrar_possiveis_casas_jogador;
+	unsigned int mostrar_possiveis_casas_jogador : 1;
+	/** \brief Mostrar apenas as casas que o jogador consegue ver (nevoeiro) */
+	unsigned int nevoeiro : 1;
+	/** \brief Bits por usar (sempre a 0, para que cópias iguais do estado tenham os mesmos bytes) */
+	unsigned int reservado : 27;
 } ESTADO;
 
+/**
+\brief Função que calcula a soma de verificação (FNV-1a) de uma cópia do estado.
+@param sequencia o número de sequência da cópia
+@param e o estado
+@returns a soma de verificação
+*/
+int soma_verificacao(int sequencia, ESTADO e);
+
+/**
+\brief Função que tranca o ficheiro de estado, para que pedidos simultâneos não percam as alterações uns dos outros.
+
+Se o ficheiro não ficar livre no tempo indicado, responde logo com "503 Service Unavailable" e termina o programa,
+em vez de deixar os pedidos acumularem-se.
+@param operacao LOCK_SH (só leitura) ou LOCK_EX (leitura e escrita)
+@param espera_ms tempo máximo de espera, em milissegundos
+@returns o descritor que mantém o ficheiro trancado (fechá-lo destranca o ficheiro), ou -1 se o ficheiro não existir
+*/
+int trancar_estado(int operacao, int espera_ms);
+
 /**
 \brief Função que converte um estado no ficheiro de estado.
+
+O ficheiro guarda duas cópias numeradas do estado, cada uma com uma soma de verificação; a escrita substitui sempre
+a cópia mais antiga, pelo que uma escrita interrompida deixa intacta a cópia anterior.
 @param e o estado
 */
 void estado2ficheiro(ESTADO e);
 
 /**
-\brief Função que converte o conteúdo do ficheiro de estado num estado.
+\brief Função que converte o conteúdo do ficheiro de estado num estado, usando a cópia válida mais recente.
+
+Se nenhuma das cópias for válida, usa-se a última fotografia do estado e, se também esta faltar, começa-se um jogo novo.
 @returns o estado correspondente ao conteúdo do ficheiro de estado
 */
 ESTADO ficheiro2estado();
 
+/**
+\brief Função que tira uma fotografia do estado, sem atrasar a resposta ao pedido.
+
+Um processo filho (fork) escreve o estado no ficheiro de fotografias, no mesmo formato de duas cópias do ficheiro de
+estado, enquanto o processo principal continua a responder ao pedido.
+@param e o estado
+*/
+void guardar_snapshot(ESTADO e);
+
 /**
 \brief Função que processa o URL / link que diz respeito ao estado do jogo.
+
+O URL tem a forma "Acao,x,y" ou, no modo sem estado, "Acao,x,y,token".
 @param *args URL
 @returns Estado
 */
 ESTADO ler_estado(char *args);
 
+/**
+\brief Função que aplica uma ação a um estado, sem ler nem escrever o ficheiro de estado.
+
+Uma deslocação que as regras não permitam (fora do tabuleiro, casa fora do alcance, ou ação diferente da que corresponde à casa) é ignorada.
+@param e o estado
+@param acao a ação a aplicar
+@param x coordenada x
+@param y coordenada y
+@returns Estado modificado
+*/
+ESTADO executar_acao(ESTADO e, char *acao, int x, int y);
+
+/**
+\brief Função que, no modo em tempo real, faz avançar os inimigos uma vez por cada período decorrido desde o último avanço.
+
+Os avanços em atraso são aplicados quando o jogo volta a ser pedido, pelo que um jogo parado não custa nada.
+Fora do tabuleiro (ecrã guardado no ficheiro diferente de 0) o tempo não avança.
+@param e o estado
+@returns Estado modificado
+*/
+ESTADO avancar_tempo(ESTADO e);
+
 /**
 \brief Função que aplica uma ação ao ficheiro de estado.
+
+O ficheiro só é reescrito se a ação alterar o jogo ou sair do tabuleiro: navegar entre o menu, o ranking e a ajuda não
+escreve nada.
+@param acao a ação a aplicar
+@param x coordenada x
+@param y coordenada y
+@returns o estado escrito no ficheiro, para que não seja preciso voltar a lê-lo
+*/
+ESTADO aplicar_acao(char *acao, int x, int y);
+
+/**
+\brief Função que aplica uma ação ao estado contido num token assinado (modo sem estado no servidor).
+
+Sem token, começa-se um jogo novo; um token inválido, adulterado ou expirado é rejeitado e o jogo recomeça no menu, sem aplicar a ação.
 @param acao a ação a aplicar
 @param x coordenada x
 @param y coordenada y
+@param token o token com o estado atual
+@returns o estado resultante
+*/
+ESTADO aplicar_acao_token(char *acao, int x, int y, char *token);
+
+/**
+\brief Estrutura que resume a aplicação de um lote de ações, para o cliente saber quais tiveram efeito.
+*/
+typedef struct lote {
+	/** \brief Número de ações aplicadas; se o lote parou numa ação rejeitada ou inválida, é também o índice dessa ação */
+	int aplicadas;
+	/** \brief Motivo da paragem: "fim", "rejeitada", "invalida", "nivel", "ecra" ou "token" */
+	char *paragem;
+} LOTE;
+
+/**
+\brief Função que aplica um lote de ações, por ordem, para clientes automáticos (API JSON).
+
+O pedido tem a forma "JSON[,token];Acao,x,y;Acao,x,y;...". As ações param na primeira que o jogo não permita ou que
+não se consiga ler, e depois de o jogador morrer ou mudar de nível; as seguintes não são aplicadas.
+@param args pedido
+@param lote onde fica o resumo do lote
+@returns o estado resultante
 */
-void aplicar_acao(char *acao, int x, int y);
+ESTADO aplicar_lote(char *args, LOTE *lote);
 
 #endif
\ No newline at end of file
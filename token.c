@@ -0,0 +1,475 @@
+#include <stdint.h>
+#include <time.h>
+
+#include "token.h"
+
+/**
+@file token.c
+Código das funções que convertem estados em tokens cifrados e assinados (modo sem estado no servidor) e vice-versa
+*/
+
+/* <----------------------------------------------------- SHA-256 / HMAC -----------------------------------------------------> */
+
+/** \brief Rotação para a direita de uma palavra de 32 bits */
+#define ROTR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+/** \brief Constantes do SHA-256 */
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/**
+\brief Estrutura que armazena o estado intermédio de um cálculo SHA-256.
+*/
+typedef struct sha256 {
+	/** \brief Valores de hash intermédios */
+	uint32_t h[8];
+	/** \brief Bloco de 64 bytes ainda por processar */
+	unsigned char bloco[64];
+	/** \brief Número de bytes no bloco */
+	size_t usados;
+	/** \brief Número total de bytes processados */
+	uint64_t total;
+} SHA256;
+
+/**
+\brief Função que processa um bloco de 64 bytes.
+@param s Cálculo SHA-256
+@param b Bloco
+*/
+static void sha256_bloco(SHA256 *s, const unsigned char *b) {
+	uint32_t w[64];
+	uint32_t a, c, d, e, f, g, h, bb;
+
+	for (int i = 0; i < 16; i++) {
+		w[i] = (uint32_t) b[4*i] << 24 | (uint32_t) b[4*i + 1] << 16 | (uint32_t) b[4*i + 2] << 8 | b[4*i + 3];
+	}
+	for (int i = 16; i < 64; i++) {
+		uint32_t s0 = ROTR(w[i-15], 7) ^ ROTR(w[i-15], 18) ^ (w[i-15] >> 3);
+		uint32_t s1 = ROTR(w[i-2], 17) ^ ROTR(w[i-2], 19) ^ (w[i-2] >> 10);
+		w[i] = w[i-16] + s0 + w[i-7] + s1;
+	}
+
+	a = s->h[0]; bb = s->h[1]; c = s->h[2]; d = s->h[3];
+	e = s->h[4]; f = s->h[5]; g = s->h[6]; h = s->h[7];
+
+	for (int i = 0; i < 64; i++) {
+		uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+		uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & bb) ^ (a & c) ^ (bb & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = bb; bb = a; a = t1 + t2;
+	}
+
+	s->h[0] += a; s->h[1] += bb; s->h[2] += c; s->h[3] += d;
+	s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+/**
+\brief Função que inicia um cálculo SHA-256.
+@param s Cálculo SHA-256
+*/
+static void sha256_iniciar(SHA256 *s) {
+	static const uint32_t h0[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	memcpy(s->h, h0, sizeof(h0));
+	s->usados = 0;
+	s->total = 0;
+}
+
+/**
+\brief Função que acrescenta dados a um cálculo SHA-256.
+@param s Cálculo SHA-256
+@param dados Dados
+@param tam Número de bytes
+*/
+static void sha256_atualizar(SHA256 *s, const unsigned char *dados, size_t tam) {
+	s->total += tam;
+	while (tam > 0) {
+		size_t n = 64 - s->usados < tam ? 64 - s->usados : tam;
+		memcpy(s->bloco + s->usados, dados, n);
+		s->usados += n;
+		dados += n;
+		tam -= n;
+		if (s->usados == 64) {
+			sha256_bloco(s, s->bloco);
+			s->usados = 0;
+		}
+	}
+}
+
+/**
+\brief Função que termina um cálculo SHA-256.
+@param s Cálculo SHA-256
+@param resultado Os 32 bytes do hash
+*/
+static void sha256_terminar(SHA256 *s, unsigned char resultado[32]) {
+	uint64_t bits = s->total * 8;
+	unsigned char fim[8];
+
+	sha256_atualizar(s, (const unsigned char *) "\x80", 1);
+	while (s->usados != 56) {
+		sha256_atualizar(s, (const unsigned char *) "", 1);
+	}
+	for (int i = 0; i < 8; i++) {
+		fim[i] = bits >> (56 - 8*i);
+	}
+	sha256_atualizar(s, fim, 8);
+
+	for (int i = 0; i < 8; i++) {
+		resultado[4*i] = s->h[i] >> 24;
+		resultado[4*i + 1] = s->h[i] >> 16;
+		resultado[4*i + 2] = s->h[i] >> 8;
+		resultado[4*i + 3] = s->h[i];
+	}
+}
+
+void hmac_sha256(const unsigned char *chave, size_t tam_chave, const unsigned char *msg, size_t tam_msg, unsigned char resultado[32]) {
+	unsigned char k[64], ipad[64], opad[64], interior[32];
+	SHA256 s;
+
+	memset(k, 0, sizeof(k));
+	if (tam_chave > 64) {
+		sha256_iniciar(&s);
+		sha256_atualizar(&s, chave, tam_chave);
+		sha256_terminar(&s, k);
+	}
+	else {
+		memcpy(k, chave, tam_chave);
+	}
+
+	for (int i = 0; i < 64; i++) {
+		ipad[i] = k[i] ^ 0x36;
+		opad[i] = k[i] ^ 0x5c;
+	}
+
+	sha256_iniciar(&s);
+	sha256_atualizar(&s, ipad, 64);
+	sha256_atualizar(&s, msg, tam_msg);
+	sha256_terminar(&s, interior);
+
+	sha256_iniciar(&s);
+	sha256_atualizar(&s, opad, 64);
+	sha256_atualizar(&s, interior, 32);
+	sha256_terminar(&s, resultado);
+}
+
+/* <------------------------------------------------------- Base64url --------------------------------------------------------> */
+
+/** \brief Alfabeto base64 seguro para URLs */
+static const char BASE64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+/**
+\brief Função que codifica bytes em base64url, sem padding.
+@param dados Bytes a codificar
+@param tam Número de bytes
+@param texto Texto resultante
+*/
+static void codificar_base64(const unsigned char *dados, size_t tam, char *texto) {
+	size_t i, n = 0;
+	for (i = 0; i + 2 < tam; i += 3) {
+		uint32_t v = (uint32_t) dados[i] << 16 | (uint32_t) dados[i+1] << 8 | dados[i+2];
+		texto[n++] = BASE64[v >> 18 & 63];
+		texto[n++] = BASE64[v >> 12 & 63];
+		texto[n++] = BASE64[v >> 6 & 63];
+		texto[n++] = BASE64[v & 63];
+	}
+	if (tam - i == 1) {
+		texto[n++] = BASE64[dados[i] >> 2];
+		texto[n++] = BASE64[(dados[i] & 3) << 4];
+	}
+	else if (tam - i == 2) {
+		texto[n++] = BASE64[dados[i] >> 2];
+		texto[n++] = BASE64[(dados[i] & 3) << 4 | dados[i+1] >> 4];
+		texto[n++] = BASE64[(dados[i+1] & 15) << 2];
+	}
+	texto[n] = '\0';
+}
+
+/**
+\brief Função que descodifica texto em base64url.
+@param texto Texto a descodificar
+@param dados Bytes resultantes
+@param max Número máximo de bytes
+@returns Número de bytes descodificados ou -1 se o texto for inválido
+*/
+static int descodificar_base64(const char *texto, unsigned char *dados, int max) {
+	uint32_t v = 0;
+	int bits = 0, n = 0;
+
+	for (; *texto; texto++) {
+		const char *c = strchr(BASE64, *texto);
+		if (c == NULL) return -1;
+
+		v = v << 6 | (uint32_t) (c - BASE64);
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			if (n == max) return -1;
+			dados[n++] = v >> bits;
+		}
+	}
+	return n;
+}
+
+/* <-------------------------------------------------- Empacotamento do estado -----------------------------------------------> */
+
+/**
+\brief Função que escreve um inteiro de 32 bits.
+@param buf Buffer
+@param n Posição de escrita, atualizada
+@param v Valor
+*/
+static void escrever_int(unsigned char *buf, int *n, int v) {
+	uint32_t u = (uint32_t) v;
+	buf[(*n)++] = u >> 24;
+	buf[(*n)++] = u >> 16;
+	buf[(*n)++] = u >> 8;
+	buf[(*n)++] = u;
+}
+
+/**
+\brief Função que lê um inteiro de 32 bits.
+@param buf Buffer
+@param n Posição de leitura, atualizada
+@returns Valor
+*/
+static int ler_int(const unsigned char *buf, int *n) {
+	uint32_t u = (uint32_t) buf[*n] << 24 | (uint32_t) buf[*n + 1] << 16 | (uint32_t) buf[*n + 2] << 8 | buf[*n + 3];
+	*n += 4;
+	return (int) u;
+}
+
+/**
+\brief Função que escreve uma posição num byte (4 bits por coordenada; 255 se a posição não existir).
+@param buf Buffer
+@param n Posição de escrita, atualizada
+@param p Posição
+*/
+static void escrever_casa(unsigned char *buf, int *n, POSICAO p) {
+	buf[(*n)++] = (p.x < 0 || p.y < 0) ? 255 : (p.y << 4 | p.x);
+}
+
+/**
+\brief Função que lê uma posição escrita por escrever_casa.
+@param buf Buffer
+@param n Posição de leitura, atualizada
+@returns Posição
+*/
+static POSICAO ler_casa(const unsigned char *buf, int *n) {
+	unsigned char c = buf[(*n)++];
+	if (c == 255) return (POSICAO){-1, -1};
+	return (POSICAO){c & 15, c >> 4};
+}
+
+/**
+\brief Função que empacota um estado em bytes.
+@param e Estado
+@param buf Buffer com espaço para o estado
+@returns Número de bytes escritos
+*/
+static int empacotar_estado(ESTADO e, unsigned char *buf) {
+	int n = 0;
+
+	buf[n++] = VERSAO_TOKEN;
+	escrever_int(buf, &n, (int) time(NULL));
+	escrever_casa(buf, &n, e.jogador);
+	buf[n++] = e.turnos_pocao2;
+	buf[n++] = e.dif;
+	escrever_int(buf, &n, e.jogadas);
+	buf[n++] = e.num_inimigos;
+	buf[n++] = e.num_obstaculos;
+	escrever_casa(buf, &n, e.pocao1);
+	escrever_casa(buf, &n, e.pocao2);
+	for (int i = 0; i < e.num_inimigos; i++) {
+		escrever_casa(buf, &n, e.inimigo[i]);
+	}
+	for (int i = 0; i < e.num_obstaculos; i++) {
+		escrever_casa(buf, &n, e.obstaculo[i]);
+	}
+	escrever_casa(buf, &n, e.entrada);
+	escrever_casa(buf, &n, e.saida);
+	buf[n++] = e.nivel;
+	escrever_int(buf, &n, e.score_atual);
+	for (int i = 0; i < NUM_SCORES; i++) {
+		escrever_int(buf, &n, e.scores[i]);
+	}
+	buf[n++] = (unsigned char) (signed char) e.idx_ultimo_score;
+	escrever_int(buf, &n, e.vidas_jogador);
+	escrever_int(buf, &n, e.inimigos_mortos);
+	buf[n++] = e.mostrar_ecra | e.mostrar_possiveis_casas_inimigos << 2 | e.mostrar_possiveis_casas_jogador << 3 | e.nevoeiro << 4;
+	escrever_int(buf, &n, e.ultimo_tick);
+
+	return n;
+}
+
+/**
+\brief Função que desempacota um estado escrito por empacotar_estado.
+@param buf Buffer
+@param tam Número de bytes no buffer
+@param e Estado lido
+@returns 1 --> Sucesso\n
+         0 --> Formato inválido ou token expirado
+*/
+static int desempacotar_estado(const unsigned char *buf, int tam, ESTADO *e) {
+	int n = 0;
+
+	memset(e, 0, sizeof(ESTADO));
+
+	if (tam < 14 || buf[n++] != VERSAO_TOKEN) return 0;
+
+	int emitido = ler_int(buf, &n);
+	if ((int) time(NULL) - emitido > VALIDADE_TOKEN) return 0;
+
+	e->jogador = ler_casa(buf, &n);
+	e->turnos_pocao2 = buf[n++];
+	e->dif = buf[n++];
+	e->jogadas = ler_int(buf, &n);
+	e->num_inimigos = buf[n++];
+	e->num_obstaculos = buf[n++];
+	if (e->num_inimigos > MAX_INIMIGOS || e->num_obstaculos > MAX_OBSTACULOS) return 0;
+	if (tam != n + 2 + e->num_inimigos + e->num_obstaculos + 3 + 4 + 4 * NUM_SCORES + 1 + 8 + 1 + 4) return 0;
+
+	e->pocao1 = ler_casa(buf, &n);
+	e->pocao2 = ler_casa(buf, &n);
+	for (int i = 0; i < e->num_inimigos; i++) {
+		e->inimigo[i] = ler_casa(buf, &n);
+	}
+	for (int i = 0; i < e->num_obstaculos; i++) {
+		e->obstaculo[i] = ler_casa(buf, &n);
+	}
+	e->entrada = ler_casa(buf, &n);
+	e->saida = ler_casa(buf, &n);
+	e->nivel = buf[n++];
+	e->score_atual = ler_int(buf, &n);
+	for (int i = 0; i < NUM_SCORES; i++) {
+		e->scores[i] = ler_int(buf, &n);
+	}
+	e->idx_ultimo_score = (signed char) buf[n++];
+	e->vidas_jogador = ler_int(buf, &n);
+	e->inimigos_mortos = ler_int(buf, &n);
+	e->mostrar_ecra = buf[n] & 3;
+	e->mostrar_possiveis_casas_inimigos = buf[n] >> 2 & 1;
+	e->mostrar_possiveis_casas_jogador = buf[n] >> 3 & 1;
+	e->nevoeiro = buf[n++] >> 4 & 1;
+	e->ultimo_tick = ler_int(buf, &n);
+
+	return 1;
+}
+
+/* <--------------------------------------------------------- Tokens ---------------------------------------------------------> */
+
+/** \brief Tamanho máximo, em bytes, de um estado empacotado, cifrado e assinado */
+#define MAX_BYTES_TOKEN		(64 + 2 * MAX_INIMIGOS + 2 * MAX_OBSTACULOS + 4 * NUM_SCORES + TAMANHO_IV + TAMANHO_ASSINATURA)
+
+/**
+\brief Função que deriva da chave secreta uma chave para um só uso, para que a cifra e a assinatura nunca partilhem a mesma chave.
+@param uso Nome do uso ("cifra" ou "assinatura")
+@param chave Os 32 bytes da chave derivada
+*/
+static void derivar_chave(const char *uso, unsigned char chave[32]) {
+	char *secreta = getenv(VARIAVEL_CHAVE);
+	hmac_sha256((const unsigned char *) secreta, strlen(secreta), (const unsigned char *) uso, strlen(uso), chave);
+}
+
+/**
+\brief Função que assina um estado cifrado.
+@param buf Vetor de inicialização seguido do estado cifrado
+@param tam Número de bytes
+@param assinatura Os TAMANHO_ASSINATURA bytes da assinatura
+*/
+static void assinar(const unsigned char *buf, int tam, unsigned char *assinatura) {
+	unsigned char chave[32], hmac[32];
+
+	derivar_chave("assinatura", chave);
+	hmac_sha256(chave, sizeof(chave), buf, tam, hmac);
+	memcpy(assinatura, hmac, TAMANHO_ASSINATURA);
+}
+
+/**
+\brief Função que calcula o vetor de inicialização de um estado empacotado.
+
+O vetor é derivado do próprio estado (que inclui o instante de emissão), pelo que estados diferentes nunca partilham a
+mesma sequência de cifra, sem ser preciso uma fonte de números aleatórios.
+@param buf Estado empacotado
+@param tam Número de bytes
+@param iv Os TAMANHO_IV bytes do vetor
+*/
+static void calcular_iv(const unsigned char *buf, int tam, unsigned char *iv) {
+	unsigned char chave[32], hmac[32];
+
+	derivar_chave("cifra", chave);
+	hmac_sha256(chave, sizeof(chave), buf, tam, hmac);
+	memcpy(iv, hmac, TAMANHO_IV);
+}
+
+/**
+\brief Função que cifra ou decifra um estado empacotado (a operação é a mesma: um ou exclusivo com uma sequência pseudo-aleatória).
+
+Cada bloco de 32 bytes da sequência é HMAC-SHA256(chave de cifra, iv ‖ contador). Estas mensagens têm TAMANHO_IV + 4 bytes,
+menos do que qualquer estado empacotado, pelo que nunca coincidem com as usadas em calcular_iv.
+@param iv Vetor de inicialização
+@param buf Bytes a cifrar ou decifrar
+@param tam Número de bytes
+*/
+static void cifrar(const unsigned char *iv, unsigned char *buf, int tam) {
+	unsigned char chave[32], bloco[32], msg[TAMANHO_IV + 4];
+
+	derivar_chave("cifra", chave);
+	memcpy(msg, iv, TAMANHO_IV);
+
+	for (int i = 0; i < tam; i += 32) {
+		int n = TAMANHO_IV;
+		escrever_int(msg, &n, i / 32);
+		hmac_sha256(chave, sizeof(chave), msg, sizeof(msg), bloco);
+		for (int j = 0; j < 32 && i + j < tam; j++) {
+			buf[i + j] ^= bloco[j];
+		}
+	}
+}
+
+int modo_sem_estado() {
+	char *chave = getenv(VARIAVEL_CHAVE);
+	return chave != NULL && chave[0] != '\0';
+}
+
+void estado2token(ESTADO e, char *token) {
+	unsigned char buf[MAX_BYTES_TOKEN];
+	int n = empacotar_estado(e, buf + TAMANHO_IV);
+
+	calcular_iv(buf + TAMANHO_IV, n, buf);
+	cifrar(buf, buf + TAMANHO_IV, n);
+	assinar(buf, TAMANHO_IV + n, buf + TAMANHO_IV + n);
+	codificar_base64(buf, TAMANHO_IV + n + TAMANHO_ASSINATURA, token);
+}
+
+int token2estado(char *token, ESTADO *e) {
+	unsigned char buf[MAX_BYTES_TOKEN];
+	unsigned char assinatura[TAMANHO_ASSINATURA];
+	unsigned char diferenca = 0;
+	int n;
+
+	if (!modo_sem_estado()) return 0;
+
+	n = descodificar_base64(token, buf, sizeof(buf));
+	if (n <= TAMANHO_IV + TAMANHO_ASSINATURA) return 0;
+	n -= TAMANHO_ASSINATURA;
+
+	/* A comparação percorre sempre todos os bytes, para não revelar quantos estão certos */
+	assinar(buf, n, assinatura);
+	for (int i = 0; i < TAMANHO_ASSINATURA; i++) {
+		diferenca |= assinatura[i] ^ buf[n + i];
+	}
+	if (diferenca != 0) return 0;
+
+	/* A assinatura cobre o estado cifrado: só um token emitido pelo servidor chega a ser decifrado */
+	cifrar(buf, buf + TAMANHO_IV, n - TAMANHO_IV);
+	return desempacotar_estado(buf + TAMANHO_IV, n - TAMANHO_IV, e);
+}
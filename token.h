@@ -0,0 +1,75 @@
+#ifndef ___TOKEN_H___
+#define ___TOKEN_H___
+
+#include "estado.h"
+
+/**
+@file token.h
+Definição das funções que convertem estados em tokens cifrados e assinados (modo sem estado no servidor) e vice-versa.
+*/
+
+/** \brief Variável de ambiente com a chave secreta; se estiver definida e não for vazia, o jogo corre no modo sem estado */
+#define VARIAVEL_CHAVE		"ROGUELIKE_CHAVE"
+
+/** \brief Versão do formato do token */
+#define VERSAO_TOKEN		3
+
+/**
+\brief Validade de um token, em segundos.
+
+Cada resposta emite um token novo, pelo que só um jogo parado mais do que isto recomeça.
+
+Limitação: o modo sem estado não rejeita tokens reutilizados. O servidor não guarda nada, logo não consegue distinguir
+um token já usado de um novo: dentro desta janela, um link antigo (por exemplo, de antes de uma morte) continua a ser
+aceite e permite repetir jogadas. Por isso, o ranking deste modo é assinalado como não verificado; só o modo com
+ficheiro de estado impede a repetição.
+*/
+#define VALIDADE_TOKEN		900
+
+/** \brief Número de bytes do vetor de inicialização da cifra, guardados no início do token */
+#define TAMANHO_IV			8
+
+/** \brief Número de bytes da assinatura guardados no token */
+#define TAMANHO_ASSINATURA	16
+
+/** \brief Tamanho máximo de um token, em caracteres (incluindo o '\\0') */
+#define TAMANHO_TOKEN		512
+
+/**
+\brief Função que verifica se o jogo corre no modo sem estado, i.e., se há uma chave secreta.
+
+Uma chave vazia não conta: com ela, qualquer pessoa poderia assinar tokens, pelo que o jogo fica no modo com ficheiro de estado.
+@returns 1 --> Modo sem estado\n
+         0 --> Modo com ficheiro de estado
+*/
+int modo_sem_estado();
+
+/**
+\brief Função que calcula o HMAC-SHA256 de uma mensagem.
+@param chave a chave secreta
+@param tam_chave o tamanho da chave
+@param msg a mensagem
+@param tam_msg o tamanho da mensagem
+@param resultado os 32 bytes do HMAC
+*/
+void hmac_sha256(const unsigned char *chave, size_t tam_chave, const unsigned char *msg, size_t tam_msg, unsigned char resultado[32]);
+
+/**
+\brief Função que converte um estado num token cifrado e assinado com a chave secreta.
+
+O estado é cifrado para que o token, presente em todos os links, não revele as posições que o nevoeiro esconde.
+@param e o estado
+@param token o token (com pelo menos TAMANHO_TOKEN caracteres)
+*/
+void estado2token(ESTADO e, char *token);
+
+/**
+\brief Função que converte um token no estado correspondente, verificando a assinatura, a versão e a validade.
+@param token o token
+@param e o estado lido
+@returns 1 --> Token válido\n
+         0 --> Token inválido, adulterado ou expirado
+*/
+int token2estado(char *token, ESTADO *e);
+
+#endif
@@ -0,0 +1,121 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "traco.h"
+
+/**
+@file traco.c
+Código das funções que medem a duração das etapas de um pedido e as exportam no formato Chrome trace / Perfetto
+*/
+
+/**
+\brief Estrutura que armazena um intervalo medido.
+*/
+typedef struct intervalo {
+	/** \brief Nome do intervalo */
+	const char *nome;
+	/** \brief Início, em microssegundos do relógio monotónico */
+	long long inicio;
+	/** \brief Duração, em microssegundos */
+	long long duracao;
+} INTERVALO;
+
+/** \brief Buffer circular com os intervalos do pedido */
+static INTERVALO intervalos[MAX_INTERVALOS];
+
+/** \brief Número de intervalos terminados no pedido */
+static int num_intervalos = 0;
+
+/** \brief 1 se o pedido estiver a ser medido */
+static int ativo = 0;
+
+/** \brief 1 enquanto a medição estiver suspensa */
+static int suspenso = 0;
+
+/** \brief Diferença entre o relógio de parede e o monotónico no início do pedido, em microssegundos */
+static long long desvio = 0;
+
+/**
+\brief Função que lê um relógio.
+@param relogio CLOCK_MONOTONIC para medir durações, CLOCK_REALTIME para saber a hora
+@returns o instante atual, em microssegundos
+*/
+static long long ler_relogio(clockid_t relogio) {
+	struct timespec t;
+	clock_gettime(relogio, &t);
+	return (long long) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+/**
+\brief Função que lê o relógio monotónico, que não salta quando a hora do sistema é acertada.
+@returns o instante atual, em microssegundos
+*/
+static long long agora() {
+	return ler_relogio(CLOCK_MONOTONIC);
+}
+
+void traco_iniciar() {
+	char *amostra = getenv(VARIAVEL_AMOSTRA);
+	int n = amostra != NULL ? atoi(amostra) : 1;
+
+	ativo = getenv(VARIAVEL_TRACO) != NULL && (n <= 1 || getpid() % n == 0);
+	if (ativo) {
+		/* A hora de parede só serve para alinhar os pedidos uns com os outros no ficheiro: é lida uma única vez */
+		desvio = ler_relogio(CLOCK_REALTIME) - agora();
+		atexit(traco_escrever);
+	}
+}
+
+long long traco_inicio() {
+	return ativo && !suspenso ? agora() : 0;
+}
+
+void traco_fim(const char *nome, long long inicio) {
+	if (inicio == 0) return;
+
+	INTERVALO *it = &intervalos[num_intervalos++ % MAX_INTERVALOS];
+	it->nome = nome;
+	it->inicio = inicio;
+	it->duracao = agora() - inicio;
+}
+
+void traco_suspender(int suspender) {
+	suspenso = suspender;
+}
+
+void traco_descartar() {
+	num_intervalos = 0;
+}
+
+void traco_escrever() {
+	if (!ativo) return;
+
+	/* Só o processo que cria o ficheiro escreve o '[' inicial: com O_EXCL, dois pedidos nunca o criam ambos */
+	int fd = open(getenv(VARIAVEL_TRACO), O_WRONLY | O_APPEND | O_CREAT | O_EXCL, 0666);
+	if (fd >= 0) {
+		if (write(fd, "[\n", 2) != 2) {
+			close(fd);
+			return;
+		}
+	}
+	else if (errno == EEXIST) {
+		fd = open(getenv(VARIAVEL_TRACO), O_WRONLY | O_APPEND);
+	}
+	if (fd < 0) return;
+
+	int total = num_intervalos < MAX_INTERVALOS ? num_intervalos : MAX_INTERVALOS;
+	for (int k = 0; k < total; k++) {
+		INTERVALO *it = &intervalos[(num_intervalos - total + k) % MAX_INTERVALOS];
+		char linha[256];
+		int n = snprintf(linha, sizeof(linha), "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d},\n",
+						 it->nome, it->inicio + desvio, it->duracao, (int) getpid(), (int) getpid());
+		if (write(fd, linha, n) != n) break;
+	}
+
+	close(fd);
+}
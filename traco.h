@@ -0,0 +1,70 @@
+#ifndef ___TRACO_H___
+#define ___TRACO_H___
+
+/**
+@file traco.h
+Definição das funções que medem a duração das etapas de um pedido e as exportam no formato Chrome trace / Perfetto.
+*/
+
+/** \brief Variável de ambiente com o caminho do ficheiro de traços; se não estiver definida, nada é medido */
+#define VARIAVEL_TRACO		"ROGUELIKE_TRACO"
+
+/** \brief Variável de ambiente com a taxa de amostragem: só 1 em cada N pedidos é medido (por omissão, todos) */
+#define VARIAVEL_AMOSTRA	"ROGUELIKE_TRACO_AMOSTRA"
+
+/** \brief Número de intervalos guardados por pedido (os mais antigos são substituídos pelos mais recentes) */
+#define MAX_INTERVALOS		1024
+
+/**
+\brief Macro que mede a duração de uma instrução.
+@param nome O nome do intervalo
+@param instrucao A instrução a medir
+*/
+#define TRACAR(nome, instrucao)		do { long long _inicio = traco_inicio(); instrucao; traco_fim(nome, _inicio); } while (0)
+
+/**
+\brief Função que decide se o pedido atual é medido, de acordo com a taxa de amostragem.
+
+Se for, os intervalos são escritos no ficheiro de traços quando o programa termina (atexit), incluindo quando um pedido é recusado com 503.
+*/
+void traco_iniciar();
+
+/**
+\brief Função que marca o início de um intervalo.
+@returns o instante atual no relógio monotónico, em microssegundos, ou 0 se o pedido não estiver a ser medido
+*/
+long long traco_inicio();
+
+/**
+\brief Função que marca o fim de um intervalo e o guarda no buffer circular.
+
+O intervalo só ocupa uma posição do buffer quando termina, pelo que os intervalos curtos e numerosos que decorrem
+dentro de um intervalo longo nunca o apagam.
+@param nome o nome do intervalo (tem de ser uma string constante)
+@param inicio o valor devolvido por traco_inicio
+*/
+void traco_fim(const char *nome, long long inicio);
+
+/**
+\brief Função que suspende ou retoma a medição, para que ciclos com milhares de intervalos curtos (as simulações do bot)
+apareçam como um só intervalo em vez de encherem o buffer.
+@param suspender 1 para suspender, 0 para retomar
+*/
+void traco_suspender(int suspender);
+
+/**
+\brief Função que esquece os intervalos já medidos (por exemplo, num processo filho, para não os escrever duas vezes).
+*/
+void traco_descartar();
+
+/**
+\brief Função que acrescenta os intervalos do pedido ao ficheiro de traços.
+
+O ficheiro usa o formato de array JSON do Chrome trace (aberto, sem o ']' final), que o chrome://tracing e o Perfetto
+carregam diretamente; o '[' inicial é escrito apenas pelo pedido que cria o ficheiro. As durações são medidas com o
+relógio monotónico e só o instante de início (ts) é convertido para a hora de parede. Cada intervalo é escrito com uma só chamada write em modo O_APPEND, pelo que vários pedidos
+podem escrever em simultâneo sem trancar o ficheiro.
+*/
+void traco_escrever();
+
+#endif